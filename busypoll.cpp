@@ -0,0 +1,72 @@
+#include "busypoll.h"
+#include <sys/socket.h>
+#include <time.h>
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+busy_poller::busy_poller(int spin_us, int busy_poll_us)
+    : m_spin_us(spin_us), m_busy_poll_us(busy_poll_us), m_empty_polls(0), m_spin_hits(0), m_sleeps(0), m_spin_ns(0), m_sleep_ns(0) {
+}
+
+int busy_poller::wait(int epollfd, epoll_event* events, int max_events, int timeout) {
+    uint64_t start = now_ns();
+    if (m_spin_us > 0) {
+        uint64_t deadline = start + (uint64_t)m_spin_us * 1000;
+        while (true) {
+            int num = epoll_wait(epollfd, events, max_events, 0);
+            uint64_t now = now_ns();
+            if (num != 0) {
+                if (num > 0) {
+                    m_spin_hits ++;
+                }
+                m_spin_ns += now - start;
+                return num;
+            }
+            m_empty_polls ++;
+            if (now >= deadline || timeout == 0) {
+                m_spin_ns += now - start;
+                start = now;
+                break;
+            }
+            cpu_relax();
+        }
+    }
+
+    m_sleeps ++;
+    int num = epoll_wait(epollfd, events, max_events, timeout);
+    m_sleep_ns += now_ns() - start;
+    return num;
+}
+
+void busy_poller::setup_socket(int fd) {
+    if (m_busy_poll_us <= 0) {
+        return;
+    }
+    // Values above net.core.busy_read need CAP_NET_ADMIN, warn once and stop trying
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &m_busy_poll_us, sizeof(m_busy_poll_us)) < 0) {
+        perror("SO_BUSY_POLL");
+        m_busy_poll_us = 0;
+    }
+}
+
+void busy_poller::dump_stats(FILE* fp) {
+    if (m_spin_us <= 0) {
+        return;
+    }
+    uint64_t total = m_spin_ns + m_sleep_ns;
+    unsigned long wakeups = m_spin_hits + m_sleeps;
+    fprintf(fp, "busy poll: %.1f%% of the wait spent spinning (spin/sleep %.3f), %lu empty polls, %lu of %lu wakeups found by spinning\n",
+        total ? 100.0 * m_spin_ns / total : 0.0, m_sleep_ns ? (double)m_spin_ns / m_sleep_ns : 0.0, m_empty_polls, m_spin_hits, wakeups);
+}
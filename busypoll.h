@@ -0,0 +1,37 @@
+// Busy polling for the event loop: trade a core for lower wakeup latency
+#ifndef BUSYPOLL_H
+#define BUSYPOLL_H
+
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+    Instead of going to sleep in epoll_wait() as soon as there's nothing to do, the loop polls with a zero timeout
+    for up to spin_us microseconds, so an event arriving meanwhile is picked up without a scheduler wakeup.
+    Only when the window runs out does it block. Sockets can additionally busy-poll the device queue (SO_BUSY_POLL).
+*/
+class busy_poller {
+public:
+    // spin_us: spinning window before blocking, 0 to always block; busy_poll_us: SO_BUSY_POLL of accepted sockets, 0 to leave it
+    busy_poller(int spin_us, int busy_poll_us);
+
+    // Same as epoll_wait(), spinning first
+    int wait(int epollfd, epoll_event* events, int max_events, int timeout);
+    // Apply SO_BUSY_POLL to an accepted socket
+    void setup_socket(int fd);
+    // Print how much of the waiting was spent spinning, and how often spinning found events
+    void dump_stats(FILE* fp);
+
+private:
+    int m_spin_us;
+    int m_busy_poll_us;
+    // Zero-timeout polls that found nothing, polls that found events, blocking waits
+    unsigned long m_empty_polls;
+    unsigned long m_spin_hits;
+    unsigned long m_sleeps;
+    uint64_t m_spin_ns;
+    uint64_t m_sleep_ns;
+};
+
+#endif
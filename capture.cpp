@@ -0,0 +1,148 @@
+#include "capture.h"
+#include "locker.h"
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+
+std::atomic<bool> capture::m_enabled(false);
+int capture::m_sample_rate = 1;
+
+namespace {
+
+// Records queued beyond this are dropped: a slow disk must not stall the workers
+const size_t MAX_PENDING = 16 * 1024 * 1024;
+
+FILE* capture_file = NULL;
+uint64_t start_ns = 0;
+std::atomic<uint32_t> connection_counter(0);
+
+locker pending_lock;
+std::string pending;
+std::atomic<bool> stopping(false);
+pthread_t writer_thread;
+
+std::atomic<unsigned long> connections(0);
+std::atomic<unsigned long> records(0);
+std::atomic<unsigned long> bytes(0);
+// Connections cut short by a dropped record
+std::atomic<unsigned long> dropped(0);
+
+uint64_t now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Swap the queue out under the lock, write it without
+void flush() {
+    std::string out;
+    pending_lock.lock();
+    out.swap(pending);
+    pending_lock.unlock();
+    if (!out.empty()) {
+        if (fwrite(out.data(), 1, out.size(), capture_file) != out.size()) {
+            perror("capture");
+        }
+        fflush(capture_file);
+    }
+}
+
+void* writer(void*) {
+    while (!stopping) {
+        usleep(100 * 1000);
+        flush();
+    }
+    return NULL;
+}
+
+}
+
+bool capture::start(const char* path, int sample_rate) {
+    capture_file = fopen(path, "w");
+    if (!capture_file) {
+        perror(path);
+        return false;
+    }
+    capture_header header;
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.start_us = now_ns(CLOCK_REALTIME) / 1000;
+    if (fwrite(&header, sizeof(header), 1, capture_file) != 1) {
+        perror(path);
+        fclose(capture_file);
+        capture_file = NULL;
+        return false;
+    }
+    start_ns = now_ns(CLOCK_MONOTONIC);
+    m_sample_rate = sample_rate > 0 ? sample_rate : 1;
+    pthread_create(&writer_thread, NULL, writer, NULL);
+    m_enabled = true;
+    return true;
+}
+
+void capture::stop() {
+    if (!m_enabled) {
+        return;
+    }
+    m_enabled = false;
+    stopping = true;
+    pthread_join(writer_thread, NULL);
+    flush();
+    fclose(capture_file);
+    capture_file = NULL;
+}
+
+uint32_t capture::sample() {
+    if (!m_enabled) {
+        return 0;
+    }
+    uint32_t n = ++connection_counter;
+    if (n % m_sample_rate != 0) {
+        return 0;
+    }
+    connections ++;
+    // Id 0 means "not captured"
+    return n / m_sample_rate;
+}
+
+bool capture::record(uint32_t conn, capture_record::TYPE type, const char* data, size_t len) {
+    if (!m_enabled) {
+        return true;
+    }
+    capture_record r;
+    r.time_us = (now_ns(CLOCK_MONOTONIC) - start_ns) / 1000;
+    r.conn = conn;
+    r.type = type;
+    r.len = len;
+    r.reserved = 0;
+
+    pending_lock.lock();
+    if (pending.size() + sizeof(r) + len > MAX_PENDING) {
+        // A replay of the connection with a gap would send different requests: end it with a mark instead. The mark
+        // goes in over the limit, a connection writes it once.
+        r.type = capture_record::DROPPED;
+        r.len = 0;
+        pending.append((const char*)&r, sizeof(r));
+        pending_lock.unlock();
+        dropped ++;
+        return false;
+    }
+    pending.append((const char*)&r, sizeof(r));
+    if (len) {
+        pending.append(data, len);
+    }
+    pending_lock.unlock();
+    records ++;
+    bytes += len;
+    return true;
+}
+
+void capture::dump_stats(FILE* fp) {
+    if (!m_enabled) {
+        return;
+    }
+    fprintf(fp, "capture: %lu connections, %lu records, %lu bytes, %lu connections cut short\n",
+        connections.load(), records.load(), bytes.load(), dropped.load());
+}
@@ -0,0 +1,61 @@
+// Sampled capture of client traffic, replayed by tools/replay
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <atomic>
+
+/*
+    Capture file:
+        capture_header
+        capture_record, followed by len bytes of data, repeated
+    Times are microseconds since the start of the capture. A sampled connection is recorded whole, from OPEN to CLOSE,
+    with the bytes of every read as they arrived, so a replay keeps its requests, their timing and the connection reuse.
+    A connection that lost a record to a full queue ends with DROPPED instead, and the replay leaves it out.
+*/
+const char CAPTURE_MAGIC[8] = {'W', 'S', 'C', 'A', 'P', '1', 0, 0};
+
+struct capture_header {
+    char magic[8];
+    // Wall-clock time of the start of the capture, in microseconds since the epoch
+    uint64_t start_us;
+};
+
+struct capture_record {
+    enum TYPE {OPEN = 0, DATA, CLOSE, DROPPED};
+    uint64_t time_us;
+    uint32_t conn;
+    uint32_t type;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+class capture {
+public:
+    // Record one connection out of every sample_rate to path
+    static bool start(const char* path, int sample_rate);
+    // Flush what's buffered and close the file
+    static void stop();
+    // Id of a new connection, 0 if capture is off or the connection isn't sampled
+    static uint32_t sample();
+    // Queue a record; the writer thread writes it out. Records are dropped rather than block a worker: false then, the
+    // connection is marked DROPPED and mustn't record anything more.
+    static bool record(uint32_t conn, capture_record::TYPE type, const char* data, size_t len);
+    static void dump_stats(FILE* fp);
+
+private:
+    // Read by the workers while stop() clears it
+    static std::atomic<bool> m_enabled;
+    static int m_sample_rate;
+};
+
+// A single predictable branch for connections that aren't sampled; a connection that loses a record stops being sampled
+#define CAPTURE(conn, type, data, len) do { \
+    if ((conn) != 0 && !capture::record((conn), capture_record::type, (data), (len))) { \
+        (conn) = 0; \
+    } \
+} while (0)
+
+#endif
@@ -0,0 +1,111 @@
+// C++20 coroutine support for connection handling
+#ifndef CORO_H
+#define CORO_H
+
+#include <coroutine>
+#include <exception>
+#include <cstddef>
+#include <new>
+
+/*
+    Per-thread free lists of coroutine frames.
+    A frame is allocated once per connection coroutine (never per co_await), and is returned to the free list
+    of whichever thread finishes the coroutine. Frames therefore migrate between threads, but every list is
+    thread local, so neither allocation nor release takes a lock.
+*/
+class frame_pool {
+public:
+    static void* allocate(size_t size) {
+        int idx = size_class(size);
+        if (idx < 0) {
+            return ::operator new(size);
+        }
+        free_list& list = lists()[idx];
+        if (list.head) {
+            block* b = list.head;
+            list.head = b->next;
+            list.count --;
+            return b;
+        }
+        return ::operator new((idx + 1) * GRANULARITY);
+    }
+
+    static void deallocate(void* ptr, size_t size) {
+        int idx = size_class(size);
+        if (idx < 0) {
+            ::operator delete(ptr);
+            return;
+        }
+        free_list& list = lists()[idx];
+        // Keep the cached memory of one thread bounded
+        if (list.count >= MAX_CACHED) {
+            ::operator delete(ptr);
+            return;
+        }
+        block* b = static_cast<block*>(ptr);
+        b->next = list.head;
+        list.head = b;
+        list.count ++;
+    }
+
+private:
+    // Frames are rounded up to a multiple of GRANULARITY; larger ones go to the global heap
+    static const size_t GRANULARITY = 64;
+    static const int SIZE_CLASSES = 64;
+    static const int MAX_CACHED = 4096;
+
+    struct block {
+        block* next;
+    };
+
+    struct free_list {
+        block* head = nullptr;
+        int count = 0;
+
+        // A worker thread that retires gives its cached frames back to the heap
+        ~free_list() {
+            while (head) {
+                block* b = head;
+                head = b->next;
+                ::operator delete(b);
+            }
+        }
+    };
+
+    static int size_class(size_t size) {
+        size_t idx = (size + GRANULARITY - 1) / GRANULARITY;
+        if (idx == 0 || idx > SIZE_CLASSES) {
+            return -1;
+        }
+        return idx - 1;
+    }
+
+    static free_list* lists() {
+        static thread_local free_list t_lists[SIZE_CLASSES];
+        return t_lists;
+    }
+};
+
+/*
+    Return type of a connection coroutine.
+    The coroutine starts suspended (the owner resumes it explicitly) and destroys its own frame when it returns,
+    so the owner only has to forget the handle once the body has finished.
+*/
+struct conn_task {
+    struct promise_type {
+        conn_task get_return_object() {
+            return conn_task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void* operator new(size_t size) { return frame_pool::allocate(size); }
+        static void operator delete(void* ptr, size_t size) { frame_pool::deallocate(ptr, size); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+#endif
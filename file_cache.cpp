@@ -0,0 +1,337 @@
+#include "file_cache.h"
+#include "membudget.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+threadpool<file_entry>* file_cache::m_loaders = nullptr;
+
+/*
+    Requests for the same file share a single mapping:
+        - A hot file (all pages already in the page cache, checked with mincore) is ready right away;
+        - A cold file is handed to a loader thread, which starts readahead and faults every page in,
+          so that writev() never blocks a worker or the main thread on disk.
+    Requests arriving while a cold file is loading wait for the same load (single-flight).
+    Files too large for the cache aren't mapped at all: every request gets its own open fd and streams it with sendfile(),
+    so a connection's memory doesn't grow with the file size.
+    Mappings are charged to the memory budget. When a file doesn't fit the budget it is streamed the same way,
+    and the budget reclaims the entries no connection uses under pressure.
+*/
+
+void file_entry::process() {
+    if (address) {
+        long page = sysconf(_SC_PAGESIZE);
+        // Start reading the whole file, then touch every page so it's mapped and resident
+        madvise(address, st.st_size, MADV_WILLNEED);
+        for (off_t off = 0; off < st.st_size; off += page) {
+            volatile char c = address[off];
+            (void)c;
+        }
+    }
+    cache->finish(this, READY);
+    // The loader's reference
+    cache->release(this);
+}
+
+file_cache::file_cache(size_t capacity) : m_size(0), m_capacity(capacity) {
+    memory_budget::add_reclaimer(reclaim, this);
+}
+
+file_cache::~file_cache() {
+    memory_budget::remove_reclaimer(this);
+    for (file_entry* entry : m_lru) {
+        entry->cached = false;
+        if (entry->refs == 0) {
+            destroy(entry);
+        }
+    }
+}
+
+void file_cache::start_loaders(int thread_number) {
+    if (thread_number > 0) {
+        m_loaders = new threadpool<file_entry>(thread_number, thread_number);
+    }
+}
+
+void file_cache::stop_loaders() {
+    // The destructor drains the pool: every queued entry is loaded and released
+    delete m_loaders;
+    m_loaders = nullptr;
+}
+
+file_cache::STATUS file_cache::acquire(const char* path, file_entry** result, unsigned long hits) {
+    *result = nullptr;
+
+    // 1. Check status, a changed file gets a new mapping
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        return FILE_NOT_FOUND;
+    }
+    if (!(st.st_mode & S_IROTH)) {
+        return FILE_FORBIDDEN;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        return FILE_IS_DIR;
+    }
+
+    // 2. Hit: share the mapping, including one that is still loading
+    m_lock.lock();
+    bool charged = false;
+    for (int pass = 0; ; ++pass) {
+        auto it = m_entries.find(path);
+        if (it != m_entries.end()) {
+            file_entry* entry = it->second;
+            if (entry->st.st_ino == st.st_ino && entry->st.st_size == st.st_size
+                && entry->st.st_mtim.tv_sec == st.st_mtim.tv_sec && entry->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+                entry->refs ++;
+                entry->hits += hits;
+                m_lru.splice(m_lru.begin(), m_lru, entry->lru);
+                STATUS status = (entry->state == file_entry::LOADING) ? FILE_PENDING : FILE_READY;
+                m_lock.unlock();
+                // Another request indexed the file while this one was charging the budget
+                if (charged) {
+                    memory_budget::uncharge(memory_budget::FILE_CACHE, st.st_size);
+                }
+                *result = entry;
+                return status;
+            }
+            // The counts belong to the path, not to the mapping
+            hits += entry->hits;
+            detach(entry);
+        }
+
+        // 3. Miss: the mapping is charged to the memory budget before the entry is indexed, so that every request
+        // joining the load gets a mapped file. try_charge() may reclaim from this cache, it's called without the lock.
+        if (pass > 0 || (size_t)st.st_size > m_capacity / 4) {
+            break;
+        }
+        m_lock.unlock();
+        charged = memory_budget::try_charge(memory_budget::FILE_CACHE, st.st_size);
+        m_lock.lock();
+        if (!charged) {
+            break;
+        }
+    }
+
+    // 4. Index the entry before mapping it, so concurrent requests wait for this load.
+    // Files too large for the cache or the budget are streamed for this request only.
+    file_entry* entry = new file_entry;
+    entry->cache = this;
+    entry->path = path;
+    entry->st = st;
+    entry->address = nullptr;
+    entry->fd = -1;
+    entry->charged = charged ? st.st_size : 0;
+    entry->state = file_entry::LOADING;
+    entry->refs = 1;
+    entry->hits = hits;
+    entry->cached = charged;
+    if (entry->cached) {
+        m_entries[entry->path] = entry;
+        m_lru.push_front(entry);
+        entry->lru = m_lru.begin();
+        m_size += st.st_size;
+        evict();
+    }
+    m_lock.unlock();
+
+    // 5. Stream a file too large for the cache or the budget
+    if (!entry->cached) {
+        if (!stream(entry)) {
+            return FILE_ERROR;
+        }
+        *result = entry;
+        return FILE_READY;
+    }
+
+    // 6. Map the file, cold files are loaded in the background
+    bool resident = false;
+    if (!map(entry, &resident)) {
+        finish(entry, file_entry::FAILED);
+        release(entry);
+        return FILE_ERROR;
+    }
+    *result = entry;
+
+    if (resident) {
+        finish(entry, file_entry::READY);
+        return FILE_READY;
+    }
+
+    // The loader holds its own reference, the connection may go away before the load finishes
+    m_lock.lock();
+    entry->refs ++;
+    m_lock.unlock();
+    if (!m_loaders || !m_loaders->append(entry)) {
+        entry->process();
+        return FILE_READY;
+    }
+    return FILE_PENDING;
+}
+
+bool file_cache::stream(file_entry* entry) {
+    int fd = open(entry->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        finish(entry, file_entry::FAILED);
+        release(entry);
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // Published under the lock like the rest of the entry's state, before it leaves LOADING
+    m_lock.lock();
+    entry->fd = fd;
+    m_lock.unlock();
+    finish(entry, file_entry::READY);
+    return true;
+}
+
+bool file_cache::map(file_entry* entry, bool* resident) {
+    *resident = true;
+    if (entry->st.st_size == 0) {
+        return true;
+    }
+
+    int fd = open(entry->path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    void* address = mmap(0, entry->st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        return false;
+    }
+    entry->address = (char*)address;
+
+    // Residency check: the lowest bit of every byte tells whether the page is in the page cache
+    long page = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> pages((entry->st.st_size + page - 1) / page);
+    if (mincore(address, entry->st.st_size, pages.data()) < 0) {
+        *resident = false;
+        return true;
+    }
+    for (unsigned char p : pages) {
+        if (!(p & 1)) {
+            *resident = false;
+            break;
+        }
+    }
+    return true;
+}
+
+bool file_cache::wait(file_entry* entry, void (*callback)(void*), void* arg) {
+    m_lock.lock();
+    if (entry->state != file_entry::LOADING) {
+        m_lock.unlock();
+        return false;
+    }
+    entry->waiters.push_back({callback, arg});
+    m_lock.unlock();
+    return true;
+}
+
+void file_cache::finish(file_entry* entry, file_entry::STATE state) {
+    m_lock.lock();
+    entry->state = state;
+    std::vector<file_entry::waiter> waiters;
+    waiters.swap(entry->waiters);
+    // Don't keep failures, the next request tries again
+    if (state == file_entry::FAILED) {
+        detach(entry);
+    }
+    m_lock.unlock();
+
+    for (file_entry::waiter& w : waiters) {
+        w.callback(w.arg);
+    }
+}
+
+void file_cache::release(file_entry* entry) {
+    m_lock.lock();
+    entry->refs --;
+    if (entry->refs == 0) {
+        if (!entry->cached) {
+            destroy(entry);
+        } else {
+            evict();
+        }
+    }
+    m_lock.unlock();
+}
+
+std::vector<file_cache::hot_file> file_cache::hot_files(size_t max) {
+    std::vector<hot_file> files;
+    m_lock.lock();
+    for (file_entry* entry : m_lru) {
+        if (entry->hits > 0 && entry->state == file_entry::READY) {
+            files.push_back({entry->path, entry->hits, entry->st.st_size});
+        }
+        entry->hits /= 2;
+    }
+    m_lock.unlock();
+
+    std::sort(files.begin(), files.end(), [](const hot_file& a, const hot_file& b) { return a.hits > b.hits; });
+    if (files.size() > max) {
+        files.resize(max);
+    }
+    return files;
+}
+
+void file_cache::detach(file_entry* entry) {
+    if (!entry->cached) {
+        return;
+    }
+    entry->cached = false;
+    m_entries.erase(entry->path);
+    m_lru.erase(entry->lru);
+    m_size -= entry->st.st_size;
+    if (entry->refs == 0) {
+        destroy(entry);
+    }
+}
+
+void file_cache::dump_stats(FILE* fp) {
+    m_lock.lock();
+    fprintf(fp, "%zu files, %.1f MB of %.1f MB cached\n", m_entries.size(), m_size / (1024.0 * 1024.0), m_capacity / (1024.0 * 1024.0));
+    m_lock.unlock();
+}
+
+size_t file_cache::reclaim(void* arg, size_t wanted) {
+    file_cache* cache = (file_cache*)arg;
+    size_t freed = 0;
+    cache->m_lock.lock();
+    auto it = cache->m_lru.end();
+    while (freed < wanted && it != cache->m_lru.begin()) {
+        file_entry* entry = *--it;
+        if (entry->refs == 0) {
+            it = std::next(it);
+            freed += entry->charged;
+            cache->detach(entry);
+        }
+    }
+    cache->m_lock.unlock();
+    return freed;
+}
+
+void file_cache::evict() {
+    auto it = m_lru.end();
+    while (m_size > m_capacity && it != m_lru.begin()) {
+        file_entry* entry = *--it;
+        if (entry->refs == 0) {
+            // detach() erases the node, step back from a valid iterator
+            it = std::next(it);
+            detach(entry);
+        }
+    }
+}
+
+void file_cache::destroy(file_entry* entry) {
+    if (entry->address) {
+        munmap(entry->address, entry->st.st_size);
+    }
+    memory_budget::uncharge(memory_budget::FILE_CACHE, entry->charged);
+    if (entry->fd >= 0) {
+        close(entry->fd);
+    }
+    delete entry;
+}
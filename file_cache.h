@@ -0,0 +1,117 @@
+// Cache of memory mapped files shared by all connections
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include "locker.h"
+#include "threadpool.h"
+
+class file_cache;
+
+// One mapped file. Connections hold a reference while they send it.
+struct file_entry {
+    // LOADING: a loader thread is faulting the pages in; READY: safe to send; FAILED: the file could not be mapped
+    enum STATE {LOADING = 0, READY, FAILED};
+
+    // Callback of a connection waiting for the file to leave the LOADING state
+    struct waiter {
+        void (*callback)(void*);
+        void* arg;
+    };
+
+    file_cache* cache;
+    std::string path;
+    // Attributes of the file when it was mapped, used to detect changes on disk
+    struct stat st;
+    // Mapped content, NULL for empty files and streamed files
+    char* address;
+    // Streamed file (too large for the cache): open file sent with sendfile(), -1 for a mapped file
+    int fd;
+    // Bytes charged to the memory budget for the mapping
+    size_t charged;
+    STATE state;
+    // References held by connections (and by the loader thread while it runs)
+    int refs;
+    // Whether the entry is still indexed by the cache
+    bool cached;
+    // Requests since the last hot-set snapshot, halved by every snapshot
+    unsigned long hits;
+    std::vector<waiter> waiters;
+    std::list<file_entry*>::iterator lru;
+
+    // Entry point of the loader thread: read the pages of a cold file into memory
+    void process();
+};
+
+class file_cache {
+public:
+    // Result of looking up a file
+    enum STATUS {FILE_READY = 0, FILE_PENDING, FILE_NOT_FOUND, FILE_FORBIDDEN, FILE_IS_DIR, FILE_ERROR};
+
+    // capacity: total bytes of mappings kept after no connection uses them any more
+    file_cache(size_t capacity);
+    ~file_cache();
+
+    // Create the loader threads shared by all caches; with 0 threads cold files are loaded by the caller
+    static void start_loaders(int thread_number);
+    // Finish the queued loads and delete the loader threads, before any cache is deleted
+    static void stop_loaders();
+
+    // A file of the hot set: the most requested cached files
+    struct hot_file {
+        std::string path;
+        unsigned long hits;
+        off_t size;
+    };
+
+    // Look up (or map) the file and take a reference on it. FILE_PENDING means a loader thread is reading it from disk.
+    // hits: requests counted for the file, the cache warmer carries over the counts of the previous run.
+    STATUS acquire(const char* path, file_entry** entry, unsigned long hits = 1);
+    // Call callback(arg) once the entry is no longer LOADING. Returns false (without calling) if it already isn't.
+    bool wait(file_entry* entry, void (*callback)(void*), void* arg);
+    // Drop a reference taken by acquire()
+    void release(file_entry* entry);
+    // Up to max cached files with the most hits, most requested first. The hits are halved, so the hot set follows the traffic.
+    std::vector<hot_file> hot_files(size_t max);
+
+    // Files and bytes cached against the capacity
+    void dump_stats(FILE* fp);
+
+    // Reclaimer of the memory budget: drop unused entries, least recently used first, until wanted bytes are freed
+    static size_t reclaim(void* cache, size_t wanted);
+
+private:
+    // Open the file to send it with sendfile() instead of mapping it. On failure the entry is released.
+    bool stream(file_entry* entry);
+    // Map the file and check whether all its pages are in the page cache
+    bool map(file_entry* entry, bool* resident);
+    // Leave the LOADING state and notify the waiters
+    void finish(file_entry* entry, file_entry::STATE state);
+    // Remove the entry from the index, free it if it's unused
+    void detach(file_entry* entry);
+    // Drop unused entries until the cache fits its capacity
+    void evict();
+    void destroy(file_entry* entry);
+
+    friend struct file_entry;
+
+private:
+    // Loader threads, shared by all caches
+    static threadpool<file_entry>* m_loaders;
+
+    locker m_lock;
+    std::unordered_map<std::string, file_entry*> m_entries;
+    // Cached entries, most recently used first
+    std::list<file_entry*> m_lru;
+    // Bytes of cached mappings
+    size_t m_size;
+    size_t m_capacity;
+};
+
+#endif
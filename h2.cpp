@@ -0,0 +1,657 @@
+#include "h2.h"
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+
+const char H2_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+namespace {
+
+enum FRAME_TYPE {DATA = 0, HEADERS, PRIORITY, RST_STREAM, SETTINGS, PUSH_PROMISE, PING, GOAWAY, WINDOW_UPDATE, CONTINUATION};
+
+const uint8_t FLAG_END_STREAM = 0x1;
+const uint8_t FLAG_ACK = 0x1;
+const uint8_t FLAG_END_HEADERS = 0x4;
+const uint8_t FLAG_PADDED = 0x8;
+const uint8_t FLAG_PRIORITY = 0x20;
+
+enum ERROR_CODE {NO_ERROR = 0, PROTOCOL_ERROR, INTERNAL_ERROR, FLOW_CONTROL_ERROR, SETTINGS_TIMEOUT, STREAM_CLOSED,
+    FRAME_SIZE_ERROR, REFUSED_STREAM, CANCEL, COMPRESSION_ERROR, CONNECT_ERROR, ENHANCE_YOUR_CALM};
+
+enum SETTING {HEADER_TABLE_SIZE = 1, ENABLE_PUSH, MAX_CONCURRENT_STREAMS, INITIAL_WINDOW_SIZE, MAX_FRAME_SIZE, MAX_HEADER_LIST_SIZE};
+
+const uint32_t STREAM_LIMIT = 256;
+// Largest frame we accept, the default SETTINGS_MAX_FRAME_SIZE
+const uint32_t FRAME_LIMIT = 16384;
+const int64_t MAX_WINDOW = 0x7fffffff;
+// Stop filling the output, and parsing frames, at this size until the socket takes it
+const size_t OUTPUT_HIGH_WATER = 64 * 1024;
+// Control frames answering the client that it leaves unread, before it's considered a flood (PING, SETTINGS, RST_STREAM)
+const uint32_t QUEUED_CONTROL_LIMIT = 1000;
+// Longest header block, CONTINUATION frames included
+const size_t HEADER_BLOCK_LIMIT = 64 * 1024;
+
+std::atomic<unsigned long> sessions(0);
+std::atomic<unsigned long> streams(0);
+std::atomic<unsigned long> refused(0);
+std::atomic<unsigned long> errors(0);
+
+uint32_t get32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+void put32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// HTTP2-Settings is the SETTINGS payload in base64url without padding
+bool base64url_decode(const char* in, std::string* out) {
+    uint32_t acc = 0;
+    int bits = 0;
+    for (; *in && *in != '\r' && *in != ' '; ++in) {
+        char c = *in;
+        int v;
+        if (c >= 'A' && c <= 'Z') {
+            v = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            v = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            v = c - '0' + 52;
+        } else if (c == '-' || c == '+') {
+            v = 62;
+        } else if (c == '_' || c == '/') {
+            v = 63;
+        } else if (c == '=') {
+            break;
+        } else {
+            return false;
+        }
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out->push_back((char)(acc >> bits));
+        }
+    }
+    return true;
+}
+
+}
+
+h2_session::h2_session(resolver resolve, void* arg)
+    : m_resolve(resolve), m_arg(arg), m_out_pos(0), m_preface(false), m_settings_received(false),
+      m_goaway_sent(false), m_goaway_received(false), m_failed(false), m_paused(false), m_control_queued(0), m_control_end(0),
+      m_last_stream(0), m_continuation(0),
+      m_continuation_end_stream(false), m_window(65535), m_initial_window(65535), m_max_frame(16384) {
+    sessions ++;
+}
+
+h2_session::~h2_session() {
+    while (!m_streams.empty()) {
+        close_stream(m_streams.begin()->second);
+    }
+}
+
+void h2_session::start() {
+    m_preface = true;
+    uint8_t settings[6];
+    settings[0] = 0;
+    settings[1] = MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, STREAM_LIMIT);
+    frame(SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+bool h2_session::start_upgrade(const char* settings, const h2_request& request) {
+    std::string payload;
+    if (!base64url_decode(settings, &payload) || payload.size() % 6 != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < payload.size(); i += 6) {
+        const uint8_t* p = (const uint8_t*)payload.data() + i;
+        if (apply_setting((p[0] << 8) | p[1], get32(p + 2)) != NO_ERROR) {
+            return false;
+        }
+    }
+    m_out.append("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    start();
+    // The upgraded request is stream 1, half-closed on the client side
+    m_last_stream = 1;
+    respond(1, request);
+    return true;
+}
+
+bool h2_session::feed(const char* data, size_t len) {
+    if (m_failed) {
+        return false;
+    }
+    if (len > 0) {
+        m_in.append(data, len);
+    }
+    m_paused = false;
+
+    if (m_preface) {
+        size_t n = m_in.size() < (size_t)H2_PREFACE_LEN ? m_in.size() : H2_PREFACE_LEN;
+        if (memcmp(m_in.data(), H2_PREFACE, n) != 0) {
+            return fail(PROTOCOL_ERROR);
+        }
+        if (n < (size_t)H2_PREFACE_LEN) {
+            return true;
+        }
+        m_in.erase(0, H2_PREFACE_LEN);
+        m_preface = false;
+    }
+
+    size_t pos = 0;
+    bool ok = true;
+    while (ok && m_in.size() - pos >= 9) {
+        // A client that sends faster than it reads: what it sent waits until it takes the output
+        if (output_size() >= OUTPUT_HIGH_WATER) {
+            m_paused = true;
+            break;
+        }
+        const uint8_t* p = (const uint8_t*)m_in.data() + pos;
+        uint32_t length = (p[0] << 16) | (p[1] << 8) | p[2];
+        if (length > FRAME_LIMIT) {
+            ok = fail(FRAME_SIZE_ERROR);
+            break;
+        }
+        if (m_in.size() - pos < 9 + length) {
+            break;
+        }
+        uint8_t type = p[3];
+        uint8_t flags = p[4];
+        uint32_t id = get32(p + 5) & 0x7fffffff;
+        // The first frame of the client must be its SETTINGS
+        if (!m_settings_received && type != SETTINGS) {
+            ok = fail(PROTOCOL_ERROR);
+            break;
+        }
+        ok = on_frame(type, flags, id, p + 9, length);
+        pos += 9 + length;
+        if (ok && m_control_queued > QUEUED_CONTROL_LIMIT) {
+            ok = fail(ENHANCE_YOUR_CALM);
+        }
+    }
+    m_in.erase(0, pos);
+    return ok;
+}
+
+bool h2_session::on_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t len) {
+    // Nothing may come between the frames of a header block
+    if (m_continuation && (type != CONTINUATION || id != m_continuation)) {
+        return fail(PROTOCOL_ERROR);
+    }
+
+    switch (type) {
+        case DATA:
+            if (id == 0 || id > m_last_stream) {
+                return fail(PROTOCOL_ERROR);
+            }
+            replenish(id, len);
+            return true;
+
+        case HEADERS:
+            return on_headers(id, flags, payload, len);
+
+        case PRIORITY:
+            if (id == 0) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (len != 5) {
+                rst_stream(id, FRAME_SIZE_ERROR);
+            }
+            return true;
+
+        case RST_STREAM: {
+            if (id == 0 || id > m_last_stream) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (len != 4) {
+                return fail(FRAME_SIZE_ERROR);
+            }
+            auto it = m_streams.find(id);
+            if (it != m_streams.end()) {
+                close_stream(it->second);
+            }
+            return true;
+        }
+
+        case SETTINGS:
+            if (id != 0) {
+                return fail(PROTOCOL_ERROR);
+            }
+            return on_settings(flags, payload, len);
+
+        case PING:
+            if (id != 0) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (len != 8) {
+                return fail(FRAME_SIZE_ERROR);
+            }
+            if (!(flags & FLAG_ACK)) {
+                frame(PING, FLAG_ACK, 0, payload, 8);
+            }
+            return true;
+
+        case GOAWAY:
+            if (id != 0) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (len < 8) {
+                return fail(FRAME_SIZE_ERROR);
+            }
+            m_goaway_received = true;
+            return true;
+
+        case WINDOW_UPDATE:
+            return on_window_update(id, payload, len);
+
+        case CONTINUATION:
+            if (!m_continuation) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (m_header_block.size() + len > HEADER_BLOCK_LIMIT) {
+                return fail(ENHANCE_YOUR_CALM);
+            }
+            m_header_block.append((const char*)payload, len);
+            if (flags & FLAG_END_HEADERS) {
+                m_continuation = 0;
+                return on_header_block(id);
+            }
+            return true;
+
+        case PUSH_PROMISE:
+            // Clients can't push
+            return fail(PROTOCOL_ERROR);
+
+        default:
+            // Unknown frame types are ignored
+            return true;
+    }
+}
+
+bool h2_session::on_headers(uint32_t id, uint8_t flags, const uint8_t* payload, uint32_t len) {
+    if (id == 0 || !(id & 1)) {
+        return fail(PROTOCOL_ERROR);
+    }
+    if (flags & FLAG_PADDED) {
+        if (len < 1 || payload[0] >= len) {
+            return fail(PROTOCOL_ERROR);
+        }
+        len -= 1 + payload[0];
+        payload += 1;
+    }
+    if (flags & FLAG_PRIORITY) {
+        if (len < 5) {
+            return fail(PROTOCOL_ERROR);
+        }
+        payload += 5;
+        len -= 5;
+    }
+    m_header_block.assign((const char*)payload, len);
+    m_continuation_end_stream = flags & FLAG_END_STREAM;
+    if (!(flags & FLAG_END_HEADERS)) {
+        m_continuation = id;
+        return true;
+    }
+    return on_header_block(id);
+}
+
+bool h2_session::on_header_block(uint32_t id) {
+    // Decode even blocks that are refused, to keep the table in sync with the client's
+    std::vector<hpack_field> fields;
+    if (!m_decoder.decode((const uint8_t*)m_header_block.data(), m_header_block.size(), &fields)) {
+        return fail(COMPRESSION_ERROR);
+    }
+    if (id <= m_last_stream) {
+        // Trailers of an open stream are ignored; a closed stream can't start again
+        return m_streams.count(id) ? true : fail(STREAM_CLOSED);
+    }
+    m_last_stream = id;
+
+    if (m_goaway_sent || m_streams.size() >= STREAM_LIMIT) {
+        refused ++;
+        rst_stream(id, REFUSED_STREAM);
+        return true;
+    }
+
+    h2_request request;
+    bool regular = false;
+    for (const hpack_field& f : fields) {
+        if (f.first[0] == ':') {
+            // Pseudo-headers come first
+            if (regular) {
+                rst_stream(id, PROTOCOL_ERROR);
+                return true;
+            }
+            if (f.first == ":method") {
+                request.method = f.second;
+            } else if (f.first == ":path") {
+                request.path = f.second;
+            } else if (f.first == ":authority") {
+                request.authority = f.second;
+            }
+        } else {
+            regular = true;
+            if (f.first == "if-none-match") {
+                request.if_none_match = f.second;
+            } else if (f.first == "host" && request.authority.empty()) {
+                request.authority = f.second;
+            }
+        }
+    }
+    if (request.method.empty() || request.path.empty()) {
+        rst_stream(id, PROTOCOL_ERROR);
+        return true;
+    }
+    respond(id, request);
+    return true;
+}
+
+void h2_session::respond(uint32_t id, const h2_request& request) {
+    stream* s = new stream;
+    s->id = id;
+    s->window = m_initial_window;
+    s->offset = 0;
+    s->ready = false;
+    memset(&s->response, 0, sizeof(s->response));
+    s->response.fd = -1;
+    m_streams[id] = s;
+    streams ++;
+
+    bool head = request.method == "HEAD";
+    if (request.method == "GET" || head) {
+        m_resolve(m_arg, request, &s->response);
+    } else {
+        // Same as HTTP/1.1: only GET is served
+        s->response.status = 400;
+    }
+    h2_response& r = s->response;
+
+    std::string block;
+    m_encoder.begin(&block);
+    m_encoder.encode(":status", std::to_string(r.status), false, &block);
+    if (r.content_type) {
+        m_encoder.encode("content-type", r.content_type, true, &block);
+    }
+    m_encoder.encode("content-length", std::to_string(r.size), false, &block);
+    if (r.etag) {
+        m_encoder.encode("etag", r.etag, false, &block);
+    }
+
+    bool body = !head && r.size > 0;
+    frame(HEADERS, FLAG_END_HEADERS | (body ? 0 : FLAG_END_STREAM), id, block.data(), block.size());
+    if (body) {
+        make_ready(s);
+    } else {
+        close_stream(s);
+    }
+}
+
+bool h2_session::on_settings(uint8_t flags, const uint8_t* payload, uint32_t len) {
+    if (flags & FLAG_ACK) {
+        return len == 0 ? true : fail(FRAME_SIZE_ERROR);
+    }
+    if (len % 6 != 0) {
+        return fail(FRAME_SIZE_ERROR);
+    }
+    for (uint32_t i = 0; i < len; i += 6) {
+        uint32_t error = apply_setting((payload[i] << 8) | payload[i + 1], get32(payload + i + 2));
+        if (error != NO_ERROR) {
+            return fail(error);
+        }
+    }
+    m_settings_received = true;
+    frame(SETTINGS, FLAG_ACK, 0, NULL, 0);
+    return true;
+}
+
+uint32_t h2_session::apply_setting(uint16_t id, uint32_t value) {
+    switch (id) {
+        case HEADER_TABLE_SIZE:
+            m_encoder.set_max_table_size(value);
+            break;
+        case ENABLE_PUSH:
+            if (value > 1) {
+                return PROTOCOL_ERROR;
+            }
+            break;
+        case INITIAL_WINDOW_SIZE: {
+            if (value > MAX_WINDOW) {
+                return FLOW_CONTROL_ERROR;
+            }
+            // Applies to the open streams too; a smaller setting can leave a window negative (RFC 7540 6.9.2),
+            // and the stream then waits for a WINDOW_UPDATE
+            int64_t delta = (int64_t)value - m_initial_window;
+            for (auto& it : m_streams) {
+                stream* s = it.second;
+                s->window += delta;
+                if (s->window > MAX_WINDOW) {
+                    return FLOW_CONTROL_ERROR;
+                }
+                if (s->window <= 0 && s->ready) {
+                    m_ready.remove(s);
+                    s->ready = false;
+                }
+                make_ready(s);
+            }
+            m_initial_window = value;
+            break;
+        }
+        case MAX_FRAME_SIZE:
+            if (value < 16384 || value > 16777215) {
+                return PROTOCOL_ERROR;
+            }
+            m_max_frame = value;
+            break;
+        default:
+            // MAX_CONCURRENT_STREAMS limits pushes, which we don't do; unknown settings are ignored
+            break;
+    }
+    return NO_ERROR;
+}
+
+bool h2_session::on_window_update(uint32_t id, const uint8_t* payload, uint32_t len) {
+    if (len != 4) {
+        return fail(FRAME_SIZE_ERROR);
+    }
+    uint32_t increment = get32(payload) & 0x7fffffff;
+    if (id == 0) {
+        if (increment == 0) {
+            return fail(PROTOCOL_ERROR);
+        }
+        m_window += increment;
+        return m_window > MAX_WINDOW ? fail(FLOW_CONTROL_ERROR) : true;
+    }
+
+    if (id > m_last_stream) {
+        return fail(PROTOCOL_ERROR);
+    }
+    auto it = m_streams.find(id);
+    if (it == m_streams.end()) {
+        // The stream finished while the update was on its way
+        return true;
+    }
+    stream* s = it->second;
+    s->window += increment;
+    if (increment == 0 || s->window > MAX_WINDOW) {
+        rst_stream(id, increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+        close_stream(s);
+        return true;
+    }
+    make_ready(s);
+    return true;
+}
+
+void h2_session::fill() {
+    // Wait for the client's SETTINGS, its windows and frame size may be smaller than the defaults.
+    // This also keeps the data of an upgraded stream 1 from following the 101 before the client has switched.
+    if (!m_settings_received) {
+        return;
+    }
+    while (output_size() < OUTPUT_HIGH_WATER && m_window > 0 && !m_ready.empty()) {
+        stream* s = m_ready.front();
+        m_ready.pop_front();
+        s->ready = false;
+        if (s->window <= 0) {
+            // Out of window, make_ready() puts it back after a WINDOW_UPDATE
+            continue;
+        }
+
+        int64_t len = s->response.size - s->offset;
+        if (len > m_max_frame) {
+            len = m_max_frame;
+        }
+        if (len > m_window) {
+            len = m_window;
+        }
+        if (len > s->window) {
+            len = s->window;
+        }
+        bool last = s->offset + len == s->response.size;
+
+        size_t at = m_out.size();
+        uint8_t header[9];
+        header[0] = len >> 16;
+        header[1] = len >> 8;
+        header[2] = len;
+        header[3] = DATA;
+        header[4] = last ? FLAG_END_STREAM : 0;
+        put32(header + 5, s->id);
+        m_out.append((const char*)header, 9);
+        if (s->response.data) {
+            m_out.append(s->response.data + s->offset, len);
+        } else {
+            m_out.resize(at + 9 + len);
+            if (pread(s->response.fd, &m_out[at + 9], len, s->offset) != len) {
+                // The file shrank, the response can't be completed
+                m_out.resize(at);
+                rst_stream(s->id, INTERNAL_ERROR);
+                close_stream(s);
+                continue;
+            }
+        }
+
+        s->offset += len;
+        s->window -= len;
+        m_window -= len;
+        if (last) {
+            close_stream(s);
+        } else {
+            // Back to the end of the line: streams take turns frame by frame
+            make_ready(s);
+        }
+    }
+}
+
+void h2_session::consume(size_t n) {
+    m_out_pos += n;
+    if (m_out_pos >= m_control_end) {
+        m_control_queued = 0;
+    }
+    if (m_out_pos == m_out.size()) {
+        m_out.clear();
+        m_out_pos = 0;
+        m_control_end = 0;
+    } else if (m_out_pos >= OUTPUT_HIGH_WATER) {
+        m_out.erase(0, m_out_pos);
+        m_control_end = m_control_end > m_out_pos ? m_control_end - m_out_pos : 0;
+        m_out_pos = 0;
+    }
+}
+
+void h2_session::shutdown() {
+    if (!m_goaway_sent) {
+        uint8_t payload[8];
+        put32(payload, m_last_stream);
+        put32(payload + 4, NO_ERROR);
+        frame(GOAWAY, 0, 0, payload, sizeof(payload));
+        m_goaway_sent = true;
+    }
+}
+
+bool h2_session::finished() const {
+    if (output_size() > 0) {
+        return false;
+    }
+    return m_failed || ((m_goaway_sent || m_goaway_received) && m_streams.empty());
+}
+
+void h2_session::close_stream(stream* s) {
+    if (s->response.release) {
+        s->response.release(s->response.file);
+    }
+    if (s->ready) {
+        m_ready.remove(s);
+    }
+    m_streams.erase(s->id);
+    delete s;
+}
+
+void h2_session::make_ready(stream* s) {
+    if (!s->ready && s->window > 0 && s->offset < s->response.size) {
+        m_ready.push_back(s);
+        s->ready = true;
+    }
+}
+
+void h2_session::frame(uint8_t type, uint8_t flags, uint32_t id, const void* payload, uint32_t len) {
+    uint8_t header[9];
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    put32(header + 5, id);
+    m_out.append((const char*)header, 9);
+    if (len) {
+        m_out.append((const char*)payload, len);
+    }
+    if (type == PING || type == SETTINGS || type == RST_STREAM || type == WINDOW_UPDATE) {
+        m_control_queued ++;
+        m_control_end = m_out.size();
+    }
+}
+
+void h2_session::rst_stream(uint32_t id, uint32_t error) {
+    uint8_t payload[4];
+    put32(payload, error);
+    frame(RST_STREAM, 0, id, payload, 4);
+}
+
+bool h2_session::fail(uint32_t error) {
+    if (!m_goaway_sent || error != NO_ERROR) {
+        uint8_t payload[8];
+        put32(payload, m_last_stream);
+        put32(payload + 4, error);
+        frame(GOAWAY, 0, 0, payload, sizeof(payload));
+        m_goaway_sent = true;
+    }
+    m_failed = true;
+    errors ++;
+    return false;
+}
+
+void h2_session::replenish(uint32_t id, uint32_t len) {
+    if (len == 0) {
+        return;
+    }
+    uint8_t payload[4];
+    put32(payload, len);
+    frame(WINDOW_UPDATE, 0, 0, payload, 4);
+    if (m_streams.count(id)) {
+        frame(WINDOW_UPDATE, 0, id, payload, 4);
+    }
+}
+
+void h2_session::dump_stats(FILE* fp) {
+    if (sessions == 0) {
+        return;
+    }
+    fprintf(fp, "http2: %lu connections, %lu streams, %lu refused, %lu connection errors\n",
+        sessions.load(), streams.load(), refused.load(), errors.load());
+}
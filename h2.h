@@ -0,0 +1,143 @@
+// HTTP/2 over cleartext TCP (h2c): framing, streams and flow control of one connection
+#ifndef H2_H
+#define H2_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include "hpack.h"
+
+// Connection preface of a client with prior knowledge, the first bytes it sends
+extern const char H2_PREFACE[];
+const int H2_PREFACE_LEN = 24;
+// Memory charged to the budget for a session: the output up to its high-water mark, a frame being read, the HPACK tables
+const size_t H2_SESSION_MEMORY = 96 * 1024;
+
+// A request of a stream, as passed to the resolver
+struct h2_request {
+    std::string method;
+    std::string path;
+    std::string authority;
+    std::string if_none_match;
+};
+
+// The response the resolver fills in; the body is a memory range or a range of an open file
+struct h2_response {
+    int status;
+    const char* content_type;
+    // ETag header, NULL for none
+    const char* etag;
+    // Body in memory (mapped file, static text), or read with pread() from fd when data is NULL
+    const char* data;
+    int fd;
+    int64_t size;
+    // Called once the stream doesn't need the body any more
+    void (*release)(void* file);
+    void* file;
+};
+
+/*
+    One HTTP/2 connection, the server side. Not thread safe: like the rest of a connection, only one thread runs it at a time.
+    The owner feeds it the bytes read from the socket and writes out what it produces:
+        feed() parses the frames, answers SETTINGS and PING, decodes header blocks, and resolves every request right away;
+        fill() turns the pending responses into frames, taking turns between the streams, within the flow-control windows;
+        output()/consume() hand the frames to the socket.
+    Request bodies are read and thrown away, as the server only serves GET and HEAD.
+*/
+class h2_session {
+public:
+    // Fills in the response of a request; arg is the one given to the constructor
+    typedef void (*resolver)(void* arg, const h2_request& request, h2_response* response);
+
+    h2_session(resolver resolve, void* arg);
+    ~h2_session();
+
+    // Prior knowledge: the client starts with the connection preface
+    void start();
+    // Upgrade from HTTP/1.1: answer 101, then the request becomes stream 1. settings is the HTTP2-Settings header.
+    bool start_upgrade(const char* settings, const h2_request& request);
+    // Parse bytes read from the socket. Returns false once the connection has failed (a GOAWAY is queued).
+    // Parsing stops while the output is over its high-water mark, feed(NULL, 0) goes on once it has drained.
+    bool feed(const char* data, size_t len);
+    // Frames are held back until the output drains: stop reading the socket
+    bool paused() const { return m_paused; }
+    // Move response data into the output while the windows allow
+    void fill();
+    const char* output() const { return m_out.data() + m_out_pos; }
+    size_t output_size() const { return m_out.size() - m_out_pos; }
+    void consume(size_t n);
+    // Graceful shutdown: GOAWAY, finish the open streams, refuse new ones
+    void shutdown();
+    // Nothing left to do on the connection, it can be closed
+    bool finished() const;
+
+    static void dump_stats(FILE* fp);
+
+private:
+    struct stream {
+        uint32_t id;
+        int64_t window;
+        h2_response response;
+        int64_t offset;
+        // In m_ready: has data to send and window to send it
+        bool ready;
+    };
+
+    bool on_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t len);
+    bool on_headers(uint32_t id, uint8_t flags, const uint8_t* payload, uint32_t len);
+    bool on_header_block(uint32_t id);
+    bool on_settings(uint8_t flags, const uint8_t* payload, uint32_t len);
+    bool on_window_update(uint32_t id, const uint8_t* payload, uint32_t len);
+    // Resolve a request and queue the response of its stream
+    void respond(uint32_t id, const h2_request& request);
+    // Returns the error code, 0 if the setting is valid
+    uint32_t apply_setting(uint16_t id, uint32_t value);
+    void close_stream(stream* s);
+    void make_ready(stream* s);
+
+    void frame(uint8_t type, uint8_t flags, uint32_t id, const void* payload, uint32_t len);
+    void rst_stream(uint32_t id, uint32_t error);
+    // Connection error: GOAWAY with the error, then nothing more is read. Returns false.
+    bool fail(uint32_t error);
+    // Keep the receive windows open, as request bodies are discarded anyway
+    void replenish(uint32_t id, uint32_t len);
+
+private:
+    resolver m_resolve;
+    void* m_arg;
+    hpack_decoder m_decoder;
+    hpack_encoder m_encoder;
+
+    std::string m_in;
+    std::string m_out;
+    size_t m_out_pos;
+
+    bool m_preface;
+    bool m_settings_received;
+    bool m_goaway_sent;
+    bool m_goaway_received;
+    bool m_failed;
+    bool m_paused;
+    // Control frames (ACKs, RST_STREAM, WINDOW_UPDATE) queued since the client last took all of them, and where they end
+    uint32_t m_control_queued;
+    size_t m_control_end;
+    // Highest stream id opened by the client
+    uint32_t m_last_stream;
+    // Header block being gathered across CONTINUATION frames, 0 if none
+    uint32_t m_continuation;
+    bool m_continuation_end_stream;
+    std::string m_header_block;
+
+    std::unordered_map<uint32_t, stream*> m_streams;
+    // Streams with data to send, in turn
+    std::list<stream*> m_ready;
+    int64_t m_window;
+    // Settings of the client
+    int64_t m_initial_window;
+    uint32_t m_max_frame;
+};
+
+#endif
@@ -0,0 +1,413 @@
+#include "hpack.h"
+#include <string.h>
+
+namespace {
+
+const hpack_field static_table[] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+    {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""},
+    {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""},
+    {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+};
+const size_t STATIC_TABLE_SIZE = sizeof(static_table) / sizeof(static_table[0]);
+
+// Longest string accepted in a header block
+const size_t MAX_STRING_LENGTH = 65536;
+
+// Huffman code of every symbol, 256 is EOS (RFC 7541 Appendix B)
+struct huffman_code {
+    uint32_t code;
+    uint8_t bits;
+};
+
+const huffman_code huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+// Binary tree of the codes for decoding, built on first use: children[node][bit], leaves are -(symbol + 1)
+struct huffman_tree {
+    int children[512][2];
+    int nodes;
+
+    huffman_tree() : nodes(1) {
+        memset(children, 0, sizeof(children));
+        for (int sym = 0; sym < 257; ++sym) {
+            int node = 0;
+            for (int i = huffman_codes[sym].bits - 1; i >= 0; --i) {
+                int bit = (huffman_codes[sym].code >> i) & 1;
+                if (i == 0) {
+                    children[node][bit] = -(sym + 1);
+                } else {
+                    if (children[node][bit] == 0) {
+                        children[node][bit] = nodes++;
+                    }
+                    node = children[node][bit];
+                }
+            }
+        }
+    }
+};
+
+const huffman_tree& tree() {
+    static huffman_tree t;
+    return t;
+}
+
+// Integer with an N-bit prefix (RFC 7541 5.1)
+bool decode_integer(const uint8_t*& p, const uint8_t* end, int prefix, size_t* value) {
+    if (p >= end) {
+        return false;
+    }
+    size_t max = (1 << prefix) - 1;
+    size_t v = *p++ & max;
+    if (v < max) {
+        *value = v;
+        return true;
+    }
+    for (int shift = 0; p < end; shift += 7) {
+        if (shift > 28) {
+            return false;
+        }
+        uint8_t b = *p++;
+        v += (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+void encode_integer(size_t value, int prefix, uint8_t first, std::string* out) {
+    size_t max = (1 << prefix) - 1;
+    if (value < max) {
+        out->push_back((char)(first | value));
+        return;
+    }
+    out->push_back((char)(first | max));
+    value -= max;
+    while (value >= 128) {
+        out->push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out->push_back((char)value);
+}
+
+bool decode_string(const uint8_t*& p, const uint8_t* end, std::string* out) {
+    if (p >= end) {
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    size_t len;
+    if (!decode_integer(p, end, 7, &len) || len > (size_t)(end - p) || len > MAX_STRING_LENGTH) {
+        return false;
+    }
+    out->clear();
+    bool ok = true;
+    if (huffman) {
+        ok = huffman_decode(p, len, out);
+    } else {
+        out->assign((const char*)p, len);
+    }
+    p += len;
+    return ok;
+}
+
+void encode_string(const std::string& s, std::string* out) {
+    size_t huffman = huffman_length(s);
+    if (huffman < s.size()) {
+        encode_integer(huffman, 7, 0x80, out);
+        huffman_encode(s, out);
+    } else {
+        encode_integer(s.size(), 7, 0, out);
+        out->append(s);
+    }
+}
+
+}
+
+bool huffman_decode(const uint8_t* data, size_t len, std::string* out) {
+    const huffman_tree& t = tree();
+    int node = 0;
+    // Bits read since the last symbol, and whether they were all ones
+    int pending = 0;
+    bool ones = true;
+    for (size_t i = 0; i < len; ++i) {
+        for (int b = 7; b >= 0; --b) {
+            int bit = (data[i] >> b) & 1;
+            int next = t.children[node][bit];
+            pending ++;
+            ones = ones && bit;
+            if (next < 0) {
+                if (next == -257) {
+                    return false;
+                }
+                out->push_back((char)(-next - 1));
+                node = 0;
+                pending = 0;
+                ones = true;
+            } else {
+                node = next;
+            }
+        }
+    }
+    // Padding: fewer than 8 bits, all ones (a prefix of EOS)
+    return pending < 8 && ones;
+}
+
+size_t huffman_length(const std::string& in) {
+    size_t bits = 0;
+    for (unsigned char c : in) {
+        bits += huffman_codes[c].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+void huffman_encode(const std::string& in, std::string* out) {
+    uint64_t acc = 0;
+    int bits = 0;
+    for (unsigned char c : in) {
+        acc = (acc << huffman_codes[c].bits) | huffman_codes[c].code;
+        bits += huffman_codes[c].bits;
+        while (bits >= 8) {
+            bits -= 8;
+            out->push_back((char)(acc >> bits));
+        }
+    }
+    if (bits > 0) {
+        // Pad with the most significant bits of EOS
+        out->push_back((char)((acc << (8 - bits)) | (0xff >> bits)));
+    }
+}
+
+hpack_table::hpack_table(size_t max_size) : m_size(0), m_max_size(max_size) {
+}
+
+void hpack_table::add(const std::string& name, const std::string& value) {
+    size_t size = name.size() + value.size() + 32;
+    while (!m_entries.empty() && m_size + size > m_max_size) {
+        m_size -= m_entries.back().first.size() + m_entries.back().second.size() + 32;
+        m_entries.pop_back();
+    }
+    // An entry larger than the table empties it and isn't added
+    if (size <= m_max_size) {
+        m_entries.push_front(hpack_field(name, value));
+        m_size += size;
+    }
+}
+
+void hpack_table::set_max_size(size_t max_size) {
+    m_max_size = max_size;
+    while (!m_entries.empty() && m_size > m_max_size) {
+        m_size -= m_entries.back().first.size() + m_entries.back().second.size() + 32;
+        m_entries.pop_back();
+    }
+}
+
+const hpack_field* hpack_table::get(size_t index) const {
+    if (index == 0) {
+        return NULL;
+    }
+    if (index <= STATIC_TABLE_SIZE) {
+        return &static_table[index - 1];
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    return index < m_entries.size() ? &m_entries[index] : NULL;
+}
+
+size_t hpack_table::find(const std::string& name, const std::string& value, bool* name_only) const {
+    size_t name_index = 0;
+    for (size_t i = 0; i < STATIC_TABLE_SIZE; ++i) {
+        if (static_table[i].first == name) {
+            if (static_table[i].second == value) {
+                *name_only = false;
+                return i + 1;
+            }
+            if (!name_index) {
+                name_index = i + 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < m_entries.size(); ++i) {
+        if (m_entries[i].first == name) {
+            if (m_entries[i].second == value) {
+                *name_only = false;
+                return STATIC_TABLE_SIZE + 1 + i;
+            }
+            if (!name_index) {
+                name_index = STATIC_TABLE_SIZE + 1 + i;
+            }
+        }
+    }
+    *name_only = true;
+    return name_index;
+}
+
+hpack_decoder::hpack_decoder(size_t max_table_size) : m_table(max_table_size), m_max_table_size(max_table_size) {
+}
+
+bool hpack_decoder::decode(const uint8_t* data, size_t len, std::vector<hpack_field>* fields) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    bool first = true;
+    while (p < end) {
+        uint8_t b = *p;
+        size_t index;
+        if (b & 0x80) {
+            // Indexed field
+            if (!decode_integer(p, end, 7, &index)) {
+                return false;
+            }
+            const hpack_field* f = m_table.get(index);
+            if (!f) {
+                return false;
+            }
+            fields->push_back(*f);
+        } else if ((b & 0xe0) == 0x20) {
+            // Dynamic table size update, only at the start of a block and within our limit
+            if (!first || !decode_integer(p, end, 5, &index) || index > m_max_table_size) {
+                return false;
+            }
+            m_table.set_max_size(index);
+            continue;
+        } else {
+            // Literal: with incremental indexing (01), without indexing (0000) or never indexed (0001)
+            bool indexing = (b & 0xc0) == 0x40;
+            if (!decode_integer(p, end, indexing ? 6 : 4, &index)) {
+                return false;
+            }
+            hpack_field f;
+            if (index) {
+                const hpack_field* named = m_table.get(index);
+                if (!named) {
+                    return false;
+                }
+                f.first = named->first;
+            } else if (!decode_string(p, end, &f.first)) {
+                return false;
+            }
+            if (!decode_string(p, end, &f.second)) {
+                return false;
+            }
+            if (indexing) {
+                m_table.add(f.first, f.second);
+            }
+            fields->push_back(f);
+        }
+        first = false;
+    }
+    return true;
+}
+
+hpack_encoder::hpack_encoder() : m_table(4096), m_size_update(false) {
+}
+
+void hpack_encoder::set_max_table_size(size_t size) {
+    // Our table stays within 4096 bytes whatever the peer allows
+    if (size > 4096) {
+        size = 4096;
+    }
+    if (size != m_table.max_size()) {
+        m_table.set_max_size(size);
+        m_size_update = true;
+    }
+}
+
+void hpack_encoder::begin(std::string* out) {
+    if (m_size_update) {
+        encode_integer(m_table.max_size(), 5, 0x20, out);
+        m_size_update = false;
+    }
+}
+
+void hpack_encoder::encode(const std::string& name, const std::string& value, bool indexed, std::string* out) {
+    bool name_only;
+    size_t index = m_table.find(name, value, &name_only);
+    if (index && !name_only) {
+        encode_integer(index, 7, 0x80, out);
+        return;
+    }
+    if (indexed) {
+        encode_integer(index, 6, 0x40, out);
+        m_table.add(name, value);
+    } else {
+        encode_integer(index, 4, 0x00, out);
+    }
+    if (!index) {
+        encode_string(name, out);
+    }
+    encode_string(value, out);
+}
@@ -0,0 +1,65 @@
+// HPACK header compression of HTTP/2 (RFC 7541)
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+
+typedef std::pair<std::string, std::string> hpack_field;
+
+// Dynamic table: newest entry first, evicted from the end when the size is over the limit
+class hpack_table {
+public:
+    hpack_table(size_t max_size);
+    void add(const std::string& name, const std::string& value);
+    void set_max_size(size_t max_size);
+    size_t max_size() const { return m_max_size; }
+    // Entry of an index counted across the static table (1-61) and the dynamic table (62-), NULL if out of range
+    const hpack_field* get(size_t index) const;
+    // Index of a matching field, 0 if none. *name_only is set when only the name matches.
+    size_t find(const std::string& name, const std::string& value, bool* name_only) const;
+
+private:
+    std::deque<hpack_field> m_entries;
+    // Sum of name + value + 32 of the entries
+    size_t m_size;
+    size_t m_max_size;
+};
+
+class hpack_decoder {
+public:
+    // max_table_size: SETTINGS_HEADER_TABLE_SIZE we advertise, the peer can't use a larger table
+    hpack_decoder(size_t max_table_size = 4096);
+    // Decode a complete header block. Returns false on a decoding error, which is a connection error (COMPRESSION_ERROR).
+    bool decode(const uint8_t* data, size_t len, std::vector<hpack_field>* fields);
+
+private:
+    hpack_table m_table;
+    size_t m_max_table_size;
+};
+
+class hpack_encoder {
+public:
+    hpack_encoder();
+    // SETTINGS_HEADER_TABLE_SIZE of the peer, announced at the start of the next header block
+    void set_max_table_size(size_t size);
+    // Start a header block
+    void begin(std::string* out);
+    // Add a field; indexed fields go into the dynamic table, so a repeated value costs one byte
+    void encode(const std::string& name, const std::string& value, bool indexed, std::string* out);
+
+private:
+    hpack_table m_table;
+    bool m_size_update;
+};
+
+// Huffman code of header strings; decoding fails on invalid padding or an EOS symbol
+bool huffman_decode(const uint8_t* data, size_t len, std::string* out);
+void huffman_encode(const std::string& in, std::string* out);
+size_t huffman_length(const std::string& in);
+
+#endif
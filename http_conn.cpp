@@ -1,9 +1,46 @@
 #include "http_conn.h"
+#include "threadpool.h"
+#include "file_cache.h"
+#include "proxy.h"
+#include "prefork.h"
+#include "membudget.h"
+#include "probes.h"
+#include "vhost.h"
 #include <strings.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <linux/tcp.h>
 
 int http_conn::m_epollfd = -1;
-int http_conn::m_user_count = 0;
+std::atomic<int> http_conn::m_user_count(0);
+bool http_conn::m_draining = false;
+threadpool<http_conn>* http_conn::m_pool = nullptr;
+pack* http_conn::m_pack = nullptr;
+buffer_pool http_conn::m_buffers(READ_BUFFER_SIZE + WRITE_BUFFER_SIZE + FILENAME_LEN + BATCH_STATE_LEN);
+bool http_conn::m_use_coroutines = false;
+bool http_conn::m_edge_triggered = false;
+
+namespace {
+
+// Free room of the write buffer for one more response of a batch: the longest headers, or an error page
+const int BATCH_HEADER_ROOM = 384;
+
+// Output counters of HTTP/1.1 (see dump_output_stats())
+std::atomic<unsigned long> responses_sent(0);
+std::atomic<unsigned long> responses_batched(0);
+std::atomic<unsigned long> send_calls(0);
+std::atomic<unsigned long> closed_responses(0);
+std::atomic<unsigned long> closed_segments(0);
+
+// Path of a request target: the absolute form (http://host:port/index.html) is reduced to its path, NULL without one
+char* request_path(char* url) {
+    if (strncasecmp(url, "http://", 7) == 0) {
+        return strchr(url + 7, '/');
+    }
+    return url;
+}
+
+}
 
 void setnonblocking(int fd) {
     int old_flag = fcntl(fd, F_GETFL);
@@ -37,32 +74,107 @@ void modfd(int epollfd, int fd, int ev) {
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
-void http_conn::init(int sockfd, const sockaddr_in & addr) {
+void http_conn::init(int sockfd, const sockaddr_in & addr, client_state* limit) {
+    char* buffers = m_buffers.get();
+    if (!buffers) {
+        printf("Out of memory for connection buffers\n");
+        rate_limiter::close_connection(limit);
+        close(sockfd);
+        return;
+    }
+    m_read_buf = buffers;
+    m_write_buf = buffers + READ_BUFFER_SIZE;
+    m_real_file = buffers + READ_BUFFER_SIZE + WRITE_BUFFER_SIZE;
+    m_iv = (struct iovec*)(m_real_file + FILENAME_LEN);
+    m_batch_files = (file_entry**)(m_iv + 2 * MAX_BATCH);
+
     m_sockfd = sockfd;
     m_address = addr;
+    m_limit = limit;
+    m_h2 = nullptr;
+    m_read_idx = 0;
+    m_checked_idx = 0;
+    m_content_length = 0;
+    m_responses = 0;
+    m_capture_id = capture::sample();
+    CAPTURE(m_capture_id, OPEN, NULL, 0);
 
     // port multiplexing
     int reuse = 1;
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
-    // Add to epoll
-    addfd(m_epollfd, m_sockfd, true);
-    m_user_count ++;
+    // Add to epoll: once for good in edge-triggered mode, with both directions and the connection as data
+    if (m_edge_triggered) {
+        m_et_state = 0;
+        m_readable = false;
+        m_writable = true;
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = this;
+        setnonblocking(m_sockfd);
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_sockfd, &event);
+    } else {
+        addfd(m_epollfd, m_sockfd, true);
+    }
+    prefork::set_connections(++m_user_count);
 
 
     // Initialization before parsing request
     init();
+    TRACE_STAGE(m_trace_id, ACCEPT, m_sockfd);
+
+    // The coroutine starts suspended, and the first EPOLLIN event enters its body
+    if(m_use_coroutines) {
+        m_coro = serve().handle;
+    }
 }
 
 void http_conn::close_conn() {
     if(m_sockfd != -1) {
-        removefd(m_epollfd, m_sockfd);
+        // Forget the fd before closing it: once closed, the main thread may accept a new client with the same fd into this object
+        unmap();
+        // The streams of an HTTP/2 connection release their files
+        if (m_h2) {
+            delete m_h2;
+            m_h2 = nullptr;
+            memory_budget::uncharge(memory_budget::HTTP2, H2_SESSION_MEMORY);
+        }
+        CAPTURE(m_capture_id, CLOSE, NULL, 0);
+        m_capture_id = 0;
+        // Segments the kernel sent for the responses of the connection, one getsockopt() per connection
+        if (m_responses > 0) {
+            struct tcp_info info;
+            socklen_t len = sizeof(info);
+            if (getsockopt(m_sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && len >= offsetof(struct tcp_info, tcpi_data_segs_out) + 4) {
+                closed_responses += m_responses;
+                closed_segments += info.tcpi_data_segs_out;
+            }
+            m_responses = 0;
+        }
+        // The buffers go back before m_sockfd is cleared, as the object may be reused right after
+        m_buffers.put(m_read_buf);
+        m_read_buf = m_write_buf = m_real_file = nullptr;
+        m_iv = nullptr;
+        m_batch_files = nullptr;
+        int sockfd = m_sockfd;
         m_sockfd = -1;
-        m_user_count --;
+        prefork::set_connections(--m_user_count);
+        rate_limiter::close_connection(m_limit);
+        m_limit = NULL;
+        removefd(m_epollfd, sockfd);
     }
 }
 
 // Read data iteratively, until there's no data or the other closes the connection
+void http_conn::drain_idle() {
+    // Racy reads: a connection that just became busy gets end of input after its request, and closes after the
+    // response anyway as m_draining turns keep-alive off. HTTP/2 connections send their GOAWAY on their next event.
+    int sockfd = m_sockfd;
+    if (sockfd != -1 && m_read_buf && m_read_idx == 0 && bytes_to_send == 0 && !m_h2) {
+        shutdown(sockfd, SHUT_RD);
+    }
+}
+
 bool http_conn::read() {
 
     if(m_read_idx >= READ_BUFFER_SIZE) {
@@ -72,10 +184,14 @@ bool http_conn::read() {
 
     // Bytes has already read
     int bytes_read = 0;
-    while(true) {
+    int start_idx = m_read_idx;
+    // Stop once the buffer is full: an HTTP/2 client may send more than a buffer before its first response,
+    // the rest is read by h2_run(); an HTTP/1.1 request that doesn't fit fails on the next read
+    while(m_read_idx < READ_BUFFER_SIZE) {
         bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
         if(bytes_read == -1) {
             if(errno == EAGAIN || errno == EWOULDBLOCK) { // no data
+                m_readable = false;
                 break;
             }
             return false;
@@ -84,37 +200,59 @@ bool http_conn::read() {
             return false;
         }
 
+        CAPTURE(m_capture_id, DATA, m_read_buf + m_read_idx, bytes_read);
         m_read_idx += bytes_read;
     }
 
+    TRACE_STAGE(m_trace_id, READ, m_sockfd);
+    PROBE2(read, m_sockfd, m_read_idx - start_idx);
     printf("Read data: %s\n", m_read_buf);
     return true;
 }
 
 void http_conn::init() {
+    // Pipelined requests after the one answered move to the start of the buffer, they are parsed without waiting for EPOLLIN.
+    // What follows a request with a body is dropped, the body isn't tracked across requests.
+    int rest = (m_content_length == 0 && m_read_idx > m_checked_idx) ? m_read_idx - m_checked_idx : 0;
+    if (rest > 0) {
+        memmove(m_read_buf, m_read_buf + m_checked_idx, rest);
+    }
+    m_read_idx = rest;
+    m_checked_idx = 0;
+    bzero(m_read_buf + rest, READ_BUFFER_SIZE - rest);
+    next_request();
+
+    m_write_idx = 0;
+    bzero(m_write_buf, WRITE_BUFFER_SIZE);
+    m_iv_count = 0;
+    m_batch_count = 0;
+    bytes_to_send = 0;
+    bytes_have_send = 0;
+    m_file_offset = 0;
+
+}
+
+void http_conn::next_request() {
     // Initial state: Request Line
     m_check_state = CHECK_STATE_REQUESTLINE; 
-    m_start_line = 0;
-    m_checked_idx = 0;
-    m_read_idx = 0;
+    m_trace_id = tracer::sample();
+    m_start_line = m_checked_idx;
     m_method = GET;  
     m_url = 0;     
     m_version = 0;
     // Don't keep connection in default
     m_linger = false; 
 
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-
     m_content_length = 0;
     m_host = 0;
-    
-    m_write_idx = 0;
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
-
-    bytes_to_send = 0;
-    bytes_have_send = 0;
+    m_if_none_match = 0;
+    m_h2_settings = 0;
+    m_h2_upgrade = false;
 
+    m_file_address = 0;
+    m_file_entry = 0;
+    m_pack_entry = 0;
+    bzero(m_real_file, FILENAME_LEN);
 }
 
 // Main State Machine
@@ -124,6 +262,15 @@ http_conn::HTTP_CODE http_conn::process_read(){
     HTTP_CODE ret = NO_REQUEST;
 
     char* text = 0;
+
+    // HTTP/2 with prior knowledge: the connection preface instead of a request line
+    if (m_checked_idx == 0 && m_read_idx > 0) {
+        int n = m_read_idx < H2_PREFACE_LEN ? m_read_idx : H2_PREFACE_LEN;
+        if (memcmp(m_read_buf, H2_PREFACE, n) == 0) {
+            return n == H2_PREFACE_LEN ? H2_REQUEST : NO_REQUEST;
+        }
+    }
+
     // Parse into request content and prior line is valid, or,
     // process the new line and it's valid:
     while (((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK))
@@ -155,6 +302,8 @@ http_conn::HTTP_CODE http_conn::process_read(){
                 // This request doesn't have request body
                 else if (ret == GET_REQUEST) {
                     return do_request();
+                } else if (ret == H2_REQUEST) {
+                    return H2_REQUEST;
                 }
                 break;
             }
@@ -247,12 +396,8 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text){
 
     // 3. Parse request file
     // /index.html\0HTTP/1.1  
-    if (strncasecmp(m_url, "http://", 7) == 0) { // http://192.168.110.129:10000/index.html
-        // 192.168.110.129:10000/index.html
-        m_url += 7;     
-        // Returns a pointer to the first occurrence of the character c in the string str.
-        m_url = strchr(m_url, '/'); 
-    }
+    // http://192.168.110.129:10000/index.html -> /index.html
+    m_url = request_path(m_url);
     if (!m_url || m_url[0] != '/' ) {
         return BAD_REQUEST;
     }
@@ -273,7 +418,10 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text){
             m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
         }
-        // Otherwise, it means we've already parsed the full request
+        // Otherwise, it means we've already parsed the full request; Upgrade: h2c turns it into stream 1 of an HTTP/2 connection
+        if (m_h2_upgrade && m_h2_settings) {
+            return H2_REQUEST;
+        }
         return GET_REQUEST;
 
     } else if (strncasecmp(text, "Connection:", 11) == 0) {
@@ -295,6 +443,21 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text){
         text += strspn(text, " \t");
         m_host = text;
 
+    } else if (strncasecmp(text, "If-None-Match:", 14) == 0) {
+        text += 14;
+        text += strspn(text, " \t");
+        m_if_none_match = text;
+
+    } else if (strncasecmp(text, "Upgrade:", 8) == 0) {
+        text += 8;
+        text += strspn(text, " \t");
+        m_h2_upgrade = strcasecmp(text, "h2c") == 0;
+
+    } else if (strncasecmp(text, "HTTP2-Settings:", 15) == 0) {
+        text += 15;
+        text += strspn(text, " \t");
+        m_h2_settings = text;
+
     } else {
         printf("Unknow header %s\n", text);
     }
@@ -325,49 +488,146 @@ const char* doc_root = "/home/yufei/code2025/resources";
 
 http_conn::HTTP_CODE http_conn::do_request() {
     printf("Start to prepare file\n");
-    // 1. Get Complete Path 
-    strcpy(m_real_file, doc_root);
-    int len = strlen(doc_root);
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
-    printf("File path: %s\n", m_real_file);
-
-    // 2. Check status 
-    // Get file attributes for file
-    if (stat(m_real_file, &m_file_stat) < 0) {
-        return NO_RESOURCE;
+    // 0. Clients over their request rate are turned away before any proxy or file work
+    if (!rate_limiter::allow_request(m_limit)) {
+        return TOO_MANY_REQUESTS;
     }
 
-    // Check access
-    if (!(m_file_stat.st_mode & S_IROTH ) ) {
-        return FORBIDDEN_REQUEST;
+    // URLs of the reverse proxy aren't files
+    m_route = proxy::match(m_url);
+    if (m_route >= 0) {
+        return PROXY_REQUEST;
     }
 
-    // Check if it's a dir
-    if (S_ISDIR(m_file_stat.st_mode)) {
-        return BAD_REQUEST;
+    // A packed archive needs a single hash lookup: no path to build, no stat, and the headers are precomputed
+    if (m_pack) {
+        m_pack_entry = m_pack->find(m_url);
+        PROBE3(resolve, m_sockfd, m_pack_entry ? file_cache::FILE_READY : file_cache::FILE_NOT_FOUND,
+            m_pack_entry ? m_pack_entry->size : 0);
+        if (!m_pack_entry) {
+            return NO_RESOURCE;
+        }
+        if (m_if_none_match && strcmp(m_if_none_match, m_pack_entry->etag) == 0) {
+            return NOT_MODIFIED;
+        }
+        m_file_size = m_pack_entry->size;
+        m_file_address = m_pack->data(m_pack_entry);
+        return FILE_REQUEST;
     }
 
-    // 3. Memory Map
-    // Open file as Read-Only
-    int fd = open(m_real_file, O_RDONLY);
-    m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
+    // 1. Get Complete Path, under the document root of the virtual host
+    vhost* host = vhost_table::find(m_host);
+    host->requests ++;
+    strcpy(m_real_file, host->root.c_str());
+    int len = host->root.size();
+    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
+    printf("File path: %s\n", m_real_file);
 
+    // 2. Check status and map the file, through the cache shared by all connections to the host
+    file_cache::STATUS status = host->cache->acquire(m_real_file, &m_file_entry);
+    PROBE3(resolve, m_sockfd, status, m_file_entry ? m_file_entry->st.st_size : 0);
+    switch (status) {
+        case file_cache::FILE_NOT_FOUND:
+            return NO_RESOURCE;
+        case file_cache::FILE_FORBIDDEN:
+            return FORBIDDEN_REQUEST;
+        case file_cache::FILE_IS_DIR:
+            return BAD_REQUEST;
+        case file_cache::FILE_ERROR:
+            return INTERNAL_ERROR;
+        default:
+            break;
+    }
+
+    // 3. A cold file is still being read by a loader thread, m_file_address is set by file_loaded()
+    m_file_size = m_file_entry->st.st_size;
+    m_file_address = m_file_entry->address;
 
     return FILE_REQUEST;
 }
 
+http_conn::HTTP_CODE http_conn::do_proxy() {
+    bool keep_alive = m_linger && !m_draining;
+    switch (proxy::forward(m_route, m_sockfd, m_address, m_url, m_host, &keep_alive)) {
+        case proxy::PROXY_DONE:
+            prefork::count_request();
+            TRACE_STAGE(m_trace_id, COMPLETE, m_sockfd);
+            return keep_alive ? PROXIED_REQUEST : CLOSED_CONNECTION;
+        case proxy::PROXY_BAD_GATEWAY:
+            return BAD_GATEWAY;
+        case proxy::PROXY_TIMEOUT:
+            return GATEWAY_TIMEOUT;
+        default:
+            return CLOSED_CONNECTION;
+    }
+}
+
 void http_conn::unmap() {
-    if(m_file_address){
-        munmap(m_file_address, m_file_stat.st_size);
+    if(m_file_entry){
+        m_file_entry->cache->release(m_file_entry);
+        m_file_entry = 0;
+    }
+    m_file_address = 0;
+    for (int i = 0; i < m_batch_count; ++i) {
+        if (m_batch_files[i]) {
+            m_batch_files[i]->cache->release(m_batch_files[i]);
+        }
+    }
+    m_batch_count = 0;
+}
+
+bool http_conn::file_loaded() {
+    if (m_file_entry->state != file_entry::READY) {
+        // Only the last response of a batch waits for its file: it becomes an error page, the others stay
+        m_file_entry->cache->release(m_file_entry);
+        m_file_entry = 0;
         m_file_address = 0;
+        m_iv_count = m_response_iov;
+        m_write_idx = m_response_write;
+        bytes_to_send = m_response_bytes;
+        return build_response(INTERNAL_ERROR);
+    }
+    m_file_address = m_file_entry->address;
+    if (m_body_iov >= 0) {
+        m_iv[m_body_iov].iov_base = m_file_address;
     }
+    TRACE_STAGE(m_trace_id, FILE_READY, m_sockfd);
+    return true;
+}
+
+void http_conn::file_ready(void* arg) {
+    http_conn* conn = (http_conn*)arg;
+
+    // Edge-triggered mode: the connection is still owned, a worker continues with the write
+    if (m_edge_triggered) {
+        if (!conn->file_loaded()) {
+            conn->close_conn();
+            return;
+        }
+        if (!m_pool->append(conn)) {
+            conn->process_et();
+        }
+        return;
+    }
+
+    // Coroutine mode: continue on a worker thread instead of the loader thread
+    if (m_use_coroutines) {
+        if (!m_pool->append(conn)) {
+            conn->resume(0);
+        }
+        return;
+    }
+
+    if (!conn->file_loaded()) {
+        conn->close_conn();
+        return;
+    }
+    modfd(m_epollfd, conn->m_sockfd, EPOLLOUT);
 }
 
 
 bool http_conn::write() {
-    int temp = 0;
-    printf("Bytes to send, %d\n", bytes_to_send);
+    printf("Bytes to send, %lld\n", (long long)bytes_to_send);
     // Bytes to send is 0, end response
     if (bytes_to_send == 0) {
         modfd(m_epollfd, m_sockfd, EPOLLIN); 
@@ -375,10 +635,9 @@ bool http_conn::write() {
         return true;
     }
 
+    int64_t written = 0;
     while(1) {
-        // Scatter write
-        printf("%s", m_file_address);
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        ssize_t temp = send_part();
         if (temp <= -1) {
             // If there is no space in the TCP write buffer, it waits for the next round of EPOLLOUT events. 
             // Although during this period, the server cannot immediately receive the next request from the same client, the integrity of the connection can be guaranteed.
@@ -390,40 +649,41 @@ bool http_conn::write() {
             return false;
         }
 
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-
-        // Check if the response header has sent
-        if (bytes_have_send >= m_iv[0].iov_len){ // sent 
-            printf("Response header has beeen sent, start to write response body\n");
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
-        }
-        else{ // header has not been sent yet
-            
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - temp;
-        }
+        written += temp;
 
         // Successfully send HTTP response
-        if (bytes_to_send <= bytes_have_send) {
+        if (bytes_to_send <= 0) {
+            TRACE_STAGE(m_trace_id, COMPLETE, m_sockfd);
+            PROBE3(write_done, m_sockfd, bytes_have_send, m_linger);
+            count_responses();
             unmap();
 
              // Check if close connection immediately according to Connection field of the request
             if(m_linger) {
                 init();
+                // Pipelined requests are already in the buffer, no EPOLLIN will come for them
+                if (m_read_idx > 0) {
+                    return m_pool->append(this);
+                }
+                modfd(m_epollfd, m_sockfd, EPOLLIN);
                 return true;
             } else {
                 return false;
             } 
         }
+
+        // A large download gives way to the other connections: the next EPOLLOUT continues it
+        if (written >= WRITE_QUANTUM) {
+            modfd(m_epollfd, m_sockfd, EPOLLOUT);
+            return true;
+        }
     }
 }
 
 
 // HTTP response code
 const char* ok_200_title = "OK";
+const char* not_modified_304_title = "Not Modified";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char* error_403_title = "Forbidden";
@@ -432,6 +692,12 @@ const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server is unreachable or sent an invalid response.\n";
+const char* error_504_title = "Gateway Timeout";
+const char* error_504_form = "The upstream server didn't respond in time.\n";
+const char* error_429_title = "Too Many Requests";
+const char* error_429_form = "You have sent too many requests, slow down.\n";
 
 // Write data to be sent into the write buffer
 bool http_conn::add_response(const char* format, ...) {
@@ -460,15 +726,12 @@ bool http_conn::add_status_line(int status, const char* title) {
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
-bool http_conn::add_headers(int content_len) {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
+bool http_conn::add_headers(off_t content_len) {
+    return add_content_length(content_len) && add_content_type() && add_linger() && add_blank_line();
 }
 
-bool http_conn::add_content_length(int content_len) {
-    return add_response("Content-Length: %d\r\n", content_len);
+bool http_conn::add_content_length(off_t content_len) {
+    return add_response("Content-Length: %lld\r\n", (long long)content_len);
 }
 
 bool http_conn::add_content_type() {
@@ -489,6 +752,37 @@ bool http_conn::add_content(const char* content) {
 
 
 bool http_conn::process_write(HTTP_CODE ret) {
+    if (!build_response(ret)) {
+        return false;
+    }
+    batch_pipelined();
+    return true;
+}
+
+void http_conn::add_iov(char* base, size_t len) {
+    if (m_iv_count > 0 && (char*)m_iv[m_iv_count - 1].iov_base + m_iv[m_iv_count - 1].iov_len == base) {
+        m_iv[m_iv_count - 1].iov_len += len;
+        return;
+    }
+    m_iv[m_iv_count].iov_base = base;
+    m_iv[m_iv_count].iov_len = len;
+    m_iv_count ++;
+}
+
+bool http_conn::build_response(HTTP_CODE ret) {
+    prefork::count_request();
+    if (m_draining) {
+        m_linger = false;
+    }
+    // The rest of a malformed request can't be told from the next one
+    if (ret == BAD_REQUEST) {
+        m_linger = false;
+    }
+    m_response_iov = m_iv_count;
+    m_response_write = m_write_idx;
+    m_response_bytes = bytes_to_send;
+    m_body_iov = -1;
+
     switch(ret) {
         case INTERNAL_ERROR:
             add_status_line(500, error_500_title);
@@ -522,50 +816,786 @@ bool http_conn::process_write(HTTP_CODE ret) {
             }
             break;
 
+        case BAD_GATEWAY:
+            add_status_line(502, error_502_title);
+            add_headers(strlen(error_502_form));
+            if (!add_content(error_502_form)) {
+                return false;
+            }
+            break;
+
+        case GATEWAY_TIMEOUT:
+            add_status_line(504, error_504_title);
+            add_headers(strlen(error_504_form));
+            if (!add_content(error_504_form)) {
+                return false;
+            }
+            break;
+
+        case TOO_MANY_REQUESTS:
+            add_status_line(429, error_429_title);
+            add_headers(strlen(error_429_form));
+            if (!add_content(error_429_form)) {
+                return false;
+            }
+            break;
+
+        case NOT_MODIFIED:
+            add_status_line(304, not_modified_304_title);
+            if (!add_response("ETag: %s\r\n", m_pack_entry->etag) || !add_linger() || !add_blank_line()) {
+                return false;
+            }
+            break;
+
         case FILE_REQUEST:
             add_status_line(200, ok_200_title);
-            add_headers(m_file_stat.st_size);
-            m_iv[0].iov_base = m_write_buf;
-            m_iv[0].iov_len = m_write_idx;
-            m_iv[1].iov_base = m_file_address;
-            m_iv[1].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
-            bytes_to_send = m_write_idx + m_file_stat.st_size;
+            if (m_pack_entry) {
+                add_response("%.*s", (int)m_pack_entry->header_len, m_pack->headers(m_pack_entry));
+                add_linger();
+                add_blank_line();
+            } else {
+                add_headers(m_file_size);
+            }
+            add_iov(m_write_buf + m_response_write, m_write_idx - m_response_write);
+            // A streamed file follows the headers through sendfile(), see send_part()
+            if (!m_file_entry || m_file_entry->fd < 0) {
+                // Not merged: file_loaded() points it at a cold file once it's read
+                m_body_iov = m_iv_count;
+                m_iv[m_iv_count].iov_base = m_file_address;
+                m_iv[m_iv_count].iov_len = m_file_size;
+                m_iv_count ++;
+            }
+            bytes_to_send += m_write_idx - m_response_write + m_file_size;
             return true;
 
         default:
             return false;
     }
 
-    m_iv[0].iov_base = m_write_buf;
-    m_iv[0].iov_len = m_write_idx;
-    m_iv_count = 1;
-    bytes_to_send = m_write_idx;
+    add_iov(m_write_buf + m_response_write, m_write_idx - m_response_write);
+    bytes_to_send += m_write_idx - m_response_write;
+    return true;
+}
+
+/*
+    Output batching:
+        A client pipelining requests gets the responses of all the complete requests already in the read buffer
+        with a single writev(), instead of one write (and as many small TCP segments) per response.
+        Only what has arrived is batched, nothing waits for more requests, and the batch ends at BATCH_BYTES,
+        at a cold or streamed file, or at a request that isn't a plain file GET. The headers of a streamed file
+        are sent with MSG_MORE, so they leave in the same segment as the start of the file.
+*/
+
+bool http_conn::pipelined_request_ready() {
+    const char* start = m_read_buf + m_checked_idx;
+    int len = m_read_idx - m_checked_idx;
+    const char* end = len > 0 ? (const char*)memmem(start, len, "\r\n\r\n", 4) : NULL;
+    if (!end || len < 4 || memcmp(start, "GET ", 4) != 0) {
+        return false;
+    }
+    // The proxy writes to the socket itself, it would overtake the batch
+    char url[FILENAME_LEN];
+    const char* url_end = start + 4;
+    while (url_end < end && *url_end != ' ' && *url_end != '\t' && *url_end != '\r') {
+        url_end ++;
+    }
+    if (url_end == end || *url_end == '\r' || url_end - start - 4 >= FILENAME_LEN) {
+        return false;
+    }
+    memcpy(url, start + 4, url_end - start - 4);
+    url[url_end - start - 4] = '\0';
+    // Routed on the same path as parse_request_line() sees
+    const char* path = request_path(url);
+    if (!path || path[0] != '/' || proxy::match(path) >= 0) {
+        return false;
+    }
+    // An upgrade switches the protocol, a body isn't batched
+    for (const char* line = url_end; line && line < end; line = (const char*)memchr(line, '\n', end - line)) {
+        line ++;
+        if (strncasecmp(line, "Upgrade:", 8) == 0 || strncasecmp(line, "Content-Length:", 15) == 0) {
+            return false;
+        }
+    }
     return true;
 }
 
+void http_conn::batch_pipelined() {
+    while (m_batch_count < MAX_BATCH - 1 && m_linger && !m_draining && m_content_length == 0
+        && bytes_to_send < BATCH_BYTES && WRITE_BUFFER_SIZE - m_write_idx >= BATCH_HEADER_ROOM
+        && m_iv_count + 2 <= 2 * MAX_BATCH
+        && (!m_file_entry || (m_file_entry->state == file_entry::READY && m_file_entry->fd < 0))
+        && pipelined_request_ready()) {
+        m_batch_files[m_batch_count++] = m_file_entry;
+        next_request();
+        HTTP_CODE read_ret = process_read();
+        PROBE2(parse, m_sockfd, read_ret);
+        responses_batched ++;
+        if (!build_response(read_ret)) {
+            // Out of room in the write buffer: the request is lost, so is the connection
+            m_linger = false;
+            return;
+        }
+    }
+}
+
 
 
 void http_conn::process() {
     // printf("Parse request, create response\n");
 
+    // Coroutine mode: the worker thread just continues the connection coroutine
+    if (m_use_coroutines) {
+        resume(0);
+        return;
+    }
+
+    if (m_edge_triggered) {
+        process_et();
+        return;
+    }
+
+    // An HTTP/2 connection reads and writes its own socket
+    if (m_h2) {
+        uint32_t interest;
+        if (h2_run(&interest)) {
+            modfd(m_epollfd, m_sockfd, interest);
+        } else {
+            close_conn();
+        }
+        return;
+    }
+
     // 1. Parse HTTP request
+    TRACE_STAGE(m_trace_id, DEQUEUE, m_sockfd);
     HTTP_CODE read_ret = process_read();
+    PROBE2(parse, m_sockfd, read_ret);
     // Incomplete request, continue reading
     if (read_ret == NO_REQUEST) {
         modfd(m_epollfd, m_sockfd, EPOLLIN);
         return;
     }
-    
+    TRACE_STAGE(m_trace_id, PARSE_DONE, m_sockfd);
+
+    if (read_ret == H2_REQUEST) {
+        if (start_h2()) {
+            process();
+            return;
+        }
+        read_ret = BAD_REQUEST;
+    }
+
+    // The proxy streams the upstream's response itself, only errors go through the write buffer
+    if (read_ret == PROXY_REQUEST) {
+        read_ret = do_proxy();
+        if (read_ret == CLOSED_CONNECTION) {
+            close_conn();
+            return;
+        }
+        if (read_ret == PROXIED_REQUEST) {
+            init();
+            if (m_read_idx > 0) {
+                process();
+                return;
+            }
+            modfd(m_epollfd, m_sockfd, EPOLLIN);
+            return;
+        }
+    }
 
     // 2. Generate response according to the result of the parsed request
     printf("Generating response...\n");
     bool write_ret = process_write(read_ret);
     if (!write_ret) {
         close_conn();
+        return;
+    }
+
+    // 3. A cold file is read by a loader thread, file_ready() starts writing once it's in memory
+    if (m_file_entry) {
+        if (m_file_entry->cache->wait(m_file_entry, file_ready, this)) {
+            return;
+        }
+        if (!file_loaded()) {
+            close_conn();
+            return;
+        }
     }
     // ONESHOT: add event everytime
     printf("Start to write response\n");
     modfd(m_epollfd, m_sockfd, EPOLLOUT);
 
-}
\ No newline at end of file
+}
+
+
+/*
+    Edge-triggered mode:
+        Sockets are registered once, for both directions, with EPOLLET; no epoll_ctl() re-arms them after a read or a write.
+        The reactor ORs the events into m_et_state and queues the connection only if no worker owns it (ET_OWNED).
+        The owner takes the pending events, reads and writes until the socket returns EAGAIN (an edge only comes
+        after that), and gives the connection back with a compare-and-swap, which fails if events came in meanwhile.
+*/
+
+void http_conn::notify(uint32_t events) {
+    uint32_t prev = m_et_state.fetch_or((events & (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) | ET_OWNED);
+    if (prev & ET_OWNED) {
+        return;
+    }
+    TRACE_STAGE(m_trace_id, ENQUEUE, m_sockfd);
+    if (!m_pool->append(this)) {
+        close_conn();
+    }
+}
+
+void http_conn::process_et() {
+    while (true) {
+        uint32_t events = m_et_state.exchange(ET_OWNED) & ~ET_OWNED;
+        if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            close_conn();
+            return;
+        }
+        if (events & EPOLLIN) {
+            m_readable = true;
+        }
+        if (events & EPOLLOUT) {
+            m_writable = true;
+        }
+
+        switch (serve_et()) {
+            case ET_CLOSE:
+                // ET_OWNED stays set: stale events of the old socket don't queue the object, init() clears it
+                close_conn();
+                return;
+            case ET_PARKED:
+                // file_ready() queues it again
+                return;
+            case ET_YIELD:
+                // Let the other connections have a turn, still owned; a full queue means continuing right away
+                if (m_pool->append(this)) {
+                    return;
+                }
+                continue;
+            default:
+                break;
+        }
+
+        uint32_t owned = ET_OWNED;
+        if (m_et_state.compare_exchange_strong(owned, 0)) {
+            return;
+        }
+    }
+}
+
+http_conn::ET_RESULT http_conn::serve_et() {
+    while (true) {
+        if (m_h2) {
+            uint32_t interest;
+            if (!h2_run(&interest)) {
+                return ET_CLOSE;
+            }
+            // EPOLLOUT with a writable socket: stopped at the write quantum
+            return (interest & EPOLLOUT) && m_writable ? ET_YIELD : ET_IDLE;
+        }
+
+        // 1. Between responses, read what's there and parse a request
+        if (bytes_to_send == 0) {
+            if (m_readable && !read()) {
+                return ET_CLOSE;
+            }
+            TRACE_STAGE(m_trace_id, DEQUEUE, m_sockfd);
+            HTTP_CODE read_ret = process_read();
+            PROBE2(parse, m_sockfd, read_ret);
+            if (read_ret == NO_REQUEST) {
+                // A request larger than the buffer can't complete, and the socket won't signal again
+                return m_read_idx >= READ_BUFFER_SIZE ? ET_CLOSE : ET_IDLE;
+            }
+            TRACE_STAGE(m_trace_id, PARSE_DONE, m_sockfd);
+
+            if (read_ret == H2_REQUEST) {
+                if (start_h2()) {
+                    continue;
+                }
+                read_ret = BAD_REQUEST;
+            }
+            if (read_ret == PROXY_REQUEST) {
+                read_ret = do_proxy();
+                if (read_ret == CLOSED_CONNECTION) {
+                    return ET_CLOSE;
+                }
+                if (read_ret == PROXIED_REQUEST) {
+                    init();
+                    continue;
+                }
+            }
+            if (!process_write(read_ret)) {
+                return ET_CLOSE;
+            }
+            if (m_file_entry) {
+                if (m_file_entry->cache->wait(m_file_entry, file_ready, this)) {
+                    return ET_PARKED;
+                }
+                if (!file_loaded()) {
+                    return ET_CLOSE;
+                }
+            }
+        }
+
+        // 2. Write until done, the socket is full, or the quantum is used up
+        int64_t written = 0;
+        while (bytes_to_send > 0) {
+            if (!m_writable) {
+                return ET_IDLE;
+            }
+            if (written >= WRITE_QUANTUM) {
+                return ET_YIELD;
+            }
+            ssize_t n = send_part();
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    m_writable = false;
+                    continue;
+                }
+                unmap();
+                return ET_CLOSE;
+            }
+            written += n;
+        }
+        TRACE_STAGE(m_trace_id, COMPLETE, m_sockfd);
+        PROBE3(write_done, m_sockfd, bytes_have_send, m_linger);
+        count_responses();
+        unmap();
+        if (!m_linger) {
+            return ET_CLOSE;
+        }
+        init();
+        // The next request may have arrived in the meantime, or been pipelined
+        if (!m_readable && m_read_idx == 0) {
+            return ET_IDLE;
+        }
+    }
+}
+
+
+/*
+    Coroutine mode:
+        Every connection is a coroutine that suspends on co_await until the reactor (main thread) or a worker thread continues it:
+            - event_awaiter: re-arms the socket with EPOLLONESHOT and waits for the event;
+            - worker_awaiter: pushes the connection to the thread pool and continues on the worker;
+            - file_awaiter: waits for a loader thread to read a cold file into memory.
+        EPOLLONESHOT guarantees that only one thread owns the coroutine at any time.
+*/
+
+void http_conn::event_awaiter::await_suspend(std::coroutine_handle<> handle) {
+    // After modfd() the coroutine may already be running on another thread, don't touch the frame again
+    http_conn* c = conn;
+    int event = ev;
+    c->m_coro = handle;
+    modfd(m_epollfd, c->m_sockfd, event);
+}
+
+bool http_conn::file_awaiter::await_suspend(std::coroutine_handle<> handle) {
+    http_conn* c = conn;
+    c->m_coro = handle;
+    // Already loaded: don't suspend
+    if (!c->m_file_entry->cache->wait(c->m_file_entry, file_ready, c)) {
+        c->m_coro = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool http_conn::worker_awaiter::await_suspend(std::coroutine_handle<> handle) {
+    http_conn* c = conn;
+    c->m_coro = handle;
+    TRACE_STAGE(c->m_trace_id, ENQUEUE, c->m_sockfd);
+    // The request queue is full: keep running on the current thread
+    if (!m_pool->append(c)) {
+        c->m_coro = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void http_conn::resume(uint32_t events) {
+    if (!m_coro) {
+        return;
+    }
+    m_revents = events;
+    std::coroutine_handle<> handle = m_coro;
+    m_coro = nullptr;
+    handle.resume();
+}
+
+ssize_t http_conn::send_part() {
+    ssize_t n;
+    send_calls ++;
+    bool streamed = m_file_entry && m_file_entry->fd >= 0;
+    // Headers (and earlier responses of the batch) still in m_iv
+    int64_t pending_iov = streamed ? bytes_to_send - (m_file_size - m_file_offset) : bytes_to_send;
+    if (streamed && pending_iov == 0) {
+        // The headers are out, stream the file in bounded chunks
+        size_t chunk = bytes_to_send < (int64_t)STREAM_CHUNK ? bytes_to_send : STREAM_CHUNK;
+        n = sendfile(m_sockfd, m_file_entry->fd, &m_file_offset, chunk);
+        if (n == 0) {
+            // The file was truncated under us, the response can't be completed
+            errno = EIO;
+            return -1;
+        }
+    } else {
+        // Skip the ranges already sent; before a streamed file, MSG_MORE holds the headers back for its first chunk
+        int first = 0;
+        while (first < m_iv_count - 1 && m_iv[first].iov_len == 0) {
+            first ++;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = m_iv + first;
+        msg.msg_iovlen = m_iv_count - first;
+        n = sendmsg(m_sockfd, &msg, streamed ? MSG_MORE : 0);
+        if (n > 0) {
+            consume_iov(n);
+        }
+    }
+    if (n > 0) {
+        prefork::count_bytes(n);
+        if (bytes_have_send == 0) {
+            TRACE_STAGE(m_trace_id, FIRST_BYTE, m_sockfd);
+        }
+        bytes_to_send -= n;
+        bytes_have_send += n;
+    }
+    return n;
+}
+
+void http_conn::consume_iov(int n) {
+    for (int i = 0; i < m_iv_count && n > 0; ++i) {
+        int len = (n < (int)m_iv[i].iov_len) ? n : m_iv[i].iov_len;
+        m_iv[i].iov_base = (char*)m_iv[i].iov_base + len;
+        m_iv[i].iov_len -= len;
+        n -= len;
+    }
+}
+
+void http_conn::count_responses() {
+    m_responses += m_batch_count + 1;
+    responses_sent += m_batch_count + 1;
+}
+
+void http_conn::dump_output_stats(FILE* fp) {
+    unsigned long responses = responses_sent.load();
+    if (responses == 0) {
+        return;
+    }
+    fprintf(fp, "output: %lu responses, %lu batched, %.2f send calls per response", responses, responses_batched.load(), (double)send_calls.load() / responses);
+    unsigned long closed = closed_responses.load();
+    if (closed > 0) {
+        fprintf(fp, ", %.2f segments per response (closed connections)", (double)closed_segments.load() / closed);
+    }
+    fprintf(fp, "\n");
+}
+
+conn_task http_conn::serve() {
+    uint32_t events = m_revents;
+    // The next request is already in the read buffer
+    bool pipelined = false;
+
+    while (true) {
+        // 1. Read the data that woke us up
+        if (!pipelined && ((events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) || !read())) {
+            break;
+        }
+        pipelined = false;
+
+        // 2. Parse on a worker thread
+        co_await worker_awaiter{this};
+        TRACE_STAGE(m_trace_id, DEQUEUE, m_sockfd);
+        HTTP_CODE read_ret = process_read();
+        PROBE2(parse, m_sockfd, read_ret);
+        if (read_ret != NO_REQUEST) {
+            TRACE_STAGE(m_trace_id, PARSE_DONE, m_sockfd);
+        }
+
+        // The rest of the connection is HTTP/2
+        if (read_ret == H2_REQUEST) {
+            if (start_h2()) {
+                uint32_t interest;
+                while (h2_run(&interest)) {
+                    uint32_t ev = co_await event_awaiter{this, (int)interest};
+                    if (ev & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                        break;
+                    }
+                    co_await worker_awaiter{this};
+                }
+                break;
+            }
+            read_ret = BAD_REQUEST;
+        }
+
+        // The proxy streams the upstream's response itself, only errors go through the write buffer
+        if (read_ret == PROXY_REQUEST) {
+            read_ret = do_proxy();
+            if (read_ret == CLOSED_CONNECTION) {
+                break;
+            }
+            if (read_ret == PROXIED_REQUEST) {
+                init();
+                pipelined = m_read_idx > 0;
+                read_ret = NO_REQUEST;
+            }
+        }
+
+        if (read_ret != NO_REQUEST) {
+            // 3. Generate and send the response, waiting for EPOLLOUT whenever the TCP write buffer is full
+            bool sent = process_write(read_ret);
+            if (sent && m_file_entry) {
+                co_await file_awaiter{this};
+                sent = file_loaded();
+            }
+            int64_t written = 0;
+            while (sent && bytes_to_send > 0) {
+                // A large download gives way to the other connections
+                if (written >= WRITE_QUANTUM) {
+                    written = 0;
+                    uint32_t ev = co_await event_awaiter{this, EPOLLOUT};
+                    if (ev & (EPOLLHUP | EPOLLERR)) {
+                        sent = false;
+                        break;
+                    }
+                }
+                ssize_t temp = send_part();
+                if (temp < 0) {
+                    if (errno != EAGAIN) {
+                        sent = false;
+                        break;
+                    }
+                    uint32_t ev = co_await event_awaiter{this, EPOLLOUT};
+                    if (ev & (EPOLLHUP | EPOLLERR)) {
+                        sent = false;
+                    }
+                    continue;
+                }
+                written += temp;
+            }
+            if (sent) {
+                TRACE_STAGE(m_trace_id, COMPLETE, m_sockfd);
+                PROBE3(write_done, m_sockfd, bytes_have_send, m_linger);
+                count_responses();
+            }
+            unmap();
+
+            if (!sent || !m_linger) {
+                break;
+            }
+            init();
+            pipelined = m_read_idx > 0;
+        }
+
+        // 4. Wait for (the rest of) the next request, unless it's been pipelined
+        if (pipelined) {
+            continue;
+        }
+        events = co_await event_awaiter{this, EPOLLIN};
+    }
+
+    close_conn();
+}
+
+
+/*
+    HTTP/2 (see h2.h):
+        The first request switches the connection, either with the connection preface or with Upgrade: h2c.
+        From then on every event of the socket goes straight to a worker thread, which reads all frames, resolves
+        the new streams, and writes the frames of all streams until the socket would block.
+        The streams share the lookup of do_request(), but a cold file is waited for on the worker thread.
+*/
+
+bool http_conn::start_h2() {
+    // Over the memory budget the connection stays HTTP/1.1 and gets an error
+    if (!memory_budget::try_charge(memory_budget::HTTP2, H2_SESSION_MEMORY)) {
+        return false;
+    }
+    m_h2 = new h2_session(h2_resolve, this);
+    const char* rest;
+    int len;
+    if (m_h2_upgrade) {
+        h2_request request;
+        request.method = "GET";
+        request.path = m_url;
+        request.authority = m_host ? m_host : "";
+        request.if_none_match = m_if_none_match ? m_if_none_match : "";
+        if (!m_h2->start_upgrade(m_h2_settings, request)) {
+            delete m_h2;
+            m_h2 = nullptr;
+            memory_budget::uncharge(memory_budget::HTTP2, H2_SESSION_MEMORY);
+            return false;
+        }
+        // The client may already have sent its preface after the request
+        rest = m_read_buf + m_checked_idx;
+        len = m_read_idx - m_checked_idx;
+    } else {
+        m_h2->start();
+        rest = m_read_buf;
+        len = m_read_idx;
+    }
+    // A failure queues a GOAWAY, h2_run() closes the connection once it's sent
+    m_h2->feed(rest, len);
+    return true;
+}
+
+bool http_conn::h2_run(uint32_t* interest) {
+    int64_t written = 0;
+    while (true) {
+        // 1. Everything the client sent, unless its output is backed up: frames held back go first, and
+        // the socket isn't read while the session is paused, so a client that doesn't read can't grow the output
+        if (m_h2->feed(NULL, 0)) {
+            while (!m_h2->paused()) {
+                ssize_t n = recv(m_sockfd, m_read_buf, READ_BUFFER_SIZE, 0);
+                if (n > 0) {
+                    if (!m_h2->feed(m_read_buf, n)) {
+                        break;
+                    }
+                    continue;
+                }
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    return false;
+                }
+                break;
+            }
+        }
+        if (m_draining) {
+            m_h2->shutdown();
+        }
+
+        // 2. Frames of all streams, until the socket is full or the connection has written its quantum
+        *interest = EPOLLIN;
+        while (true) {
+            m_h2->fill();
+            if (m_h2->output_size() == 0) {
+                break;
+            }
+            if (written >= WRITE_QUANTUM) {
+                *interest |= EPOLLOUT;
+                break;
+            }
+            ssize_t n = send(m_sockfd, m_h2->output(), m_h2->output_size(), 0);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    *interest |= EPOLLOUT;
+                    m_writable = false;
+                    break;
+                }
+                return false;
+            }
+            m_h2->consume(n);
+            prefork::count_bytes(n);
+            written += n;
+        }
+
+        // The output drained with frames still held back: no EPOLLIN will come for them
+        if (m_h2->paused() && m_h2->output_size() == 0) {
+            continue;
+        }
+        break;
+    }
+    // Paused: only the socket taking the output lets the session go on
+    if (m_h2->paused()) {
+        *interest = EPOLLOUT;
+    }
+    return !m_h2->finished();
+}
+
+void http_conn::h2_release(void* file) {
+    file_entry* entry = (file_entry*)file;
+    entry->cache->release(entry);
+}
+
+static void h2_error(h2_response* response, int status, const char* form) {
+    response->status = status;
+    response->content_type = "text/html";
+    response->data = form;
+    response->size = strlen(form);
+}
+
+// Wakes up a worker waiting for a cold file
+static void h2_file_ready(void* arg) {
+    ((sem*)arg)->post();
+}
+
+void http_conn::h2_resolve(void* arg, const h2_request& request, h2_response* response) {
+    http_conn* conn = (http_conn*)arg;
+    prefork::count_request();
+    if (!rate_limiter::allow_request(conn->m_limit)) {
+        h2_error(response, 429, error_429_form);
+        return;
+    }
+    // The proxy speaks HTTP/1.1 to the client socket, it can't answer on a stream
+    if (proxy::match(request.path.c_str()) >= 0) {
+        h2_error(response, 502, error_502_form);
+        return;
+    }
+
+    if (m_pack) {
+        const pack_entry* entry = m_pack->find(request.path.c_str());
+        if (!entry) {
+            h2_error(response, 404, error_404_form);
+            return;
+        }
+        response->etag = entry->etag;
+        if (request.if_none_match == entry->etag) {
+            response->status = 304;
+            return;
+        }
+        // The Content-Type of the precomputed headers, copied out as the encoder needs a string
+        static thread_local char content_type[128];
+        const char* headers = m_pack->headers(entry);
+        const char* type = (const char*)memmem(headers, entry->header_len, "Content-Type: ", 14);
+        if (type) {
+            type += 14;
+            const char* end = (const char*)memchr(type, '\r', headers + entry->header_len - type);
+            snprintf(content_type, sizeof(content_type), "%.*s", end ? (int)(end - type) : 0, type);
+            response->content_type = content_type;
+        }
+        response->status = 200;
+        response->data = m_pack->data(entry);
+        response->size = entry->size;
+        return;
+    }
+
+    vhost* host = vhost_table::find(request.authority.c_str());
+    host->requests ++;
+    char path[FILENAME_LEN];
+    snprintf(path, sizeof(path), "%s%s", host->root.c_str(), request.path.c_str());
+    file_entry* entry;
+    switch (host->cache->acquire(path, &entry)) {
+        case file_cache::FILE_NOT_FOUND:
+            h2_error(response, 404, error_404_form);
+            return;
+        case file_cache::FILE_FORBIDDEN:
+            h2_error(response, 403, error_403_form);
+            return;
+        case file_cache::FILE_IS_DIR:
+            h2_error(response, 400, error_400_form);
+            return;
+        case file_cache::FILE_ERROR:
+            h2_error(response, 500, error_500_form);
+            return;
+        default:
+            break;
+    }
+    // The other streams of the connection wait while a loader thread reads a cold file
+    sem done;
+    if (host->cache->wait(entry, h2_file_ready, &done)) {
+        done.wait();
+    }
+    if (entry->state != file_entry::READY) {
+        host->cache->release(entry);
+        h2_error(response, 500, error_500_form);
+        return;
+    }
+    response->status = 200;
+    response->content_type = "text/html";
+    response->data = entry->fd >= 0 ? NULL : entry->address;
+    response->fd = entry->fd;
+    response->size = entry->st.st_size;
+    response->release = h2_release;
+    response->file = entry;
+}
@@ -16,21 +16,56 @@
 #include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "coro.h"
+#include "trace.h"
+#include "ratelimit.h"
+#include "pack.h"
+#include "hugepage.h"
+#include "h2.h"
+#include "capture.h"
 #include <sys/uio.h>
+#include <atomic>
 
-class http_conn {
+template<typename T> class threadpool;
+class file_cache;
+struct file_entry;
+
+// Aligned so that the hot fields of a connection start on a cache line
+class alignas(64) http_conn {
 public:
 
     // All socket events will be registered in the same epoll event
     static int m_epollfd;
-    // Number of users
-    static int m_user_count;
+    // Number of users, changed by the main thread and the worker threads
+    static std::atomic<int> m_user_count;
+    // Graceful shutdown: finish the current responses but don't keep any connection alive
+    static bool m_draining;
+    // Thread pool that parses requests
+    static threadpool<http_conn>* m_pool;
+    // Archive the files are served from instead of doc_root, NULL to use doc_root
+    static pack* m_pack;
+    // Whether every connection runs as a coroutine (see serve()) instead of the event-driven state machine
+    static bool m_use_coroutines;
+    // Edge-triggered mode: sockets are registered once with data.ptr, and handed to the workers with m_et_state (see notify())
+    static bool m_edge_triggered;
     // Maximum length of request file name
     static const int FILENAME_LEN = 200;
 
     // Size of read and write buffer
     static const int READ_BUFFER_SIZE = 2048;
     static const int WRITE_BUFFER_SIZE = 1024;
+    // Largest sendfile() of a streamed file
+    static const size_t STREAM_CHUNK = 256 * 1024;
+    // Bytes a connection may write before giving way to the other ready connections
+    static const int64_t WRITE_QUANTUM = 1024 * 1024;
+    // Pipelined requests answered with one batch of writes (see batch_pipelined()), and the size after which no
+    // response joins the batch, so that the first response isn't held back
+    static const int MAX_BATCH = 8;
+    static const int64_t BATCH_BYTES = 64 * 1024;
+    // Output state of a batch in the buffer block, after the file name: the iovecs, then the files
+    static const int BATCH_STATE_LEN = sizeof(struct iovec) * 2 * MAX_BATCH + sizeof(file_entry*) * (MAX_BATCH - 1);
+    // Read buffer, write buffer, file name and batch state of every open connection
+    static buffer_pool m_buffers;
 
 
     // HTTP request method, only GET is supported here
@@ -52,8 +87,16 @@ public:
         FILE_REQUEST: File request, file acquisition is successful; 
         INTERNAL_ERROR: An internal server error; 
         CLOSED_CONNECTION: iThe client has closed the connection 
+        PROXY_REQUEST: The URL belongs to an upstream (see proxy.h);
+        PROXIED_REQUEST: The response of the upstream has been sent to the client;
+        BAD_GATEWAY: The upstream is unreachable or its response is invalid;
+        GATEWAY_TIMEOUT: The upstream didn't respond in time;
+        TOO_MANY_REQUESTS: The client is over its request rate (see ratelimit.h);
+        NOT_MODIFIED: The client already has the packed file, its If-None-Match is the ETag;
+        H2_REQUEST: The client speaks HTTP/2, with the connection preface or an Upgrade: h2c request
     */
-    enum HTTP_CODE {NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE {NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION,
+        PROXY_REQUEST, PROXIED_REQUEST, BAD_GATEWAY, GATEWAY_TIMEOUT, TOO_MANY_REQUESTS, NOT_MODIFIED, H2_REQUEST };
 
     /*
         Three possible states of the state machine (i.e., the read state of the line):
@@ -69,70 +112,172 @@ public:
 
     // Process client request, entry function for the worker thread in the thread pool to process http requests
     void process();
-    // Initialize new accepted connection
-    void init(int sockfd, const sockaddr_in & addr);
+    // Initialize new accepted connection, limit is the state of the client returned by rate_limiter::open_connection()
+    void init(int sockfd, const sockaddr_in & addr, client_state* limit = NULL);
     // Close connection
     void close_conn();
     // Non-blocking read
     bool read();
     // Non-blocking write
     bool write();
+    // Coroutine mode: continue the connection coroutine with the epoll events that woke it up
+    void resume(uint32_t events);
+    // Edge-triggered mode: events of the socket, queues the connection unless a worker already owns it
+    void notify(uint32_t events);
+    // Trace id of the current request, 0 if it isn't traced
+    uint64_t trace_id() const { return m_trace_id; }
+    // Responses, batching, send calls and TCP segments of the HTTP/1.1 responses
+    static void dump_output_stats(FILE* fp);
+    // The connection switched to HTTP/2: the worker reads and writes the socket itself, see h2_run()
+    bool is_h2() const { return m_h2 != nullptr; }
+    // Graceful shutdown, from the main thread: end the input of an idle keep-alive connection, so that it closes
+    // on its own event path instead of holding up the drain; a connection in the middle of a request is left alone
+    void drain_idle();
 
 private:
+    /*
+        Hot fields, touched by every event of the connection: kept together in the first cache lines of the object.
+        The buffers live in huge-page pools (see hugepage.h) and are only attached while the connection is open,
+        so the connection table stays small and the buffers of the open connections are packed together.
+    */
     // Socket for current HTTP connection
     int m_sockfd;
-    // Socket address
-    sockaddr_in m_address;
-    // Buffer for reading
-    char m_read_buf[READ_BUFFER_SIZE];
+    // Current state of the main state machine
+    CHECK_STATE m_check_state;
     // Next position of the last byte of client data that has been read into the read buffer
     int m_read_idx;
-
-
     // Position of the character currently being parsed in the read buffer
-    int m_checked_idx;      
+    int m_checked_idx;
     // Starting position of the line currently being parsed
-    int m_start_line;                       
-    // Current state of the main state machine
-    CHECK_STATE m_check_state;      
-   
+    int m_start_line;
+    // Number of bytes to be sent in the write buffer
+    int m_write_idx;
+    int m_iv_count;
+    // Whether the HTTP request requires a connection to be maintained
+    bool m_linger;
+    // The number of bytes to be sent
+    int64_t bytes_to_send = 0;
+    // The number of bytes have sent
+    int64_t bytes_have_send = 0;
+    // Next offset of a streamed file
+    off_t m_file_offset;
+    // Epoll events delivered by the last resume()
+    uint32_t m_revents = 0;
+    // Buffer for reading, READ_BUFFER_SIZE bytes
+    char* m_read_buf = nullptr;
+    // Write buffer, WRITE_BUFFER_SIZE bytes
+    char* m_write_buf = nullptr;
+    // Scatter/gather write, which allow both write buffer and requested resource(m_file_address) to write in a single system call:
+    // the headers and body of every response of the batch, 2 * MAX_BATCH entries in the buffer block
+    struct iovec* m_iv = nullptr;
+    // Suspended connection coroutine waiting for an event (coroutine mode only)
+    std::coroutine_handle<> m_coro = nullptr;
+    // Trace id of the current request, see tracer::sample()
+    uint64_t m_trace_id;
+    // HTTP/2 session once the connection has switched, nullptr for HTTP/1.1
+    h2_session* m_h2;
+    // Capture id of the connection, 0 if its traffic isn't recorded (see capture.h)
+    uint32_t m_capture_id;
+    // Edge-triggered mode: ET_OWNED while a worker has the connection, plus the epoll events it hasn't seen yet
+    std::atomic<uint32_t> m_et_state;
+    // Edge-triggered mode: the socket may have data to read / room to write, until a call returns EAGAIN
+    bool m_readable;
+    bool m_writable;
 
-    METHOD m_method;       
+    // Cold fields, used once per request
+    METHOD m_method;
+    // Total length of the HTTP request message
+    int m_content_length;
+    // Proxy route of the URL, -1 if it's served from doc_root
+    int m_route;
     // File name of the target file requested by the client
-    char* m_url; 
-    // HTTP protocol version number (only support HTTP1.1)                           
-    char* m_version;    
-    // Host name                   
-    char* m_host;   
-    // Total length of the HTTP request message                    
-    int m_content_length;   
-    // Whether the HTTP request requires a connection to be maintained               
-    bool m_linger;  
-    // Full path of the target file requested by the client, which is doc_root + m_url (doc_root is the root dir)
-    char m_real_file[FILENAME_LEN];   
-
-    // Status of file
-    struct stat m_file_stat;
+    char* m_url;
+    // HTTP protocol version number (only support HTTP1.1)
+    char* m_version;
+    // Host name
+    char* m_host;
+    // ETag of the If-None-Match header, NULL if there's none
+    char* m_if_none_match;
+    // HTTP2-Settings header of an Upgrade: h2c request, NULL if the client doesn't ask for HTTP/2
+    char* m_h2_settings;
+    bool m_h2_upgrade;
+    // Connection count and request bucket of the client IP, NULL if it isn't limited
+    client_state* m_limit;
+    // Entry of the requested file in m_pack
+    const pack_entry* m_pack_entry;
+    // Full path of the target file requested by the client, the root of its virtual host + m_url; FILENAME_LEN bytes in the buffer block
+    char* m_real_file = nullptr;
+    // Size of the requested file
+    off_t m_file_size;
     // File address of the requested file, which is mmapped to the memory
-    char* m_file_address;      
+    char* m_file_address;
+    // Cached mapping of the requested file, m_file_address is valid once it's loaded
+    file_entry* m_file_entry;
+    // Socket address
+    sockaddr_in m_address;
+    // Files of the earlier responses of the batch, released once it's sent; NULL for responses without a cached file.
+    // MAX_BATCH - 1 entries in the buffer block.
+    file_entry** m_batch_files = nullptr;
+    int m_batch_count;
+    // The last response of the batch: index of its body in m_iv (-1 without one), and where it starts, to replace it with an error
+    int m_body_iov;
+    int m_response_iov;
+    int m_response_write;
+    int64_t m_response_bytes;
+    // Responses sent on this connection, for the segments per response
+    uint32_t m_responses;
 
+    // Suspend the connection coroutine until the reactor reports the event on the socket
+    struct event_awaiter {
+        http_conn* conn;
+        int ev;
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> handle);
+        uint32_t await_resume() { return conn->m_revents; }
+    };
 
-    // Write buffer
-    char m_write_buf[ WRITE_BUFFER_SIZE ]; 
-    // Number of bytes to be sent in the write buffer
-    int m_write_idx;  
-    // Scatter/gather write, which allow both write buffer and requested resource(m_file_address) to write in a single system call
-    struct iovec m_iv[2];                  
-    int m_iv_count;         
-    // The number of bytes to be sent   
-    int bytes_to_send = 0;
-    // The number of bytes have sent
-    int bytes_have_send = 0;
-    
+    // Suspend the connection coroutine and continue it on a thread of the thread pool
+    struct worker_awaiter {
+        http_conn* conn;
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> handle);
+        void await_resume() {}
+    };
+
+    // Suspend the connection coroutine while a loader thread reads a cold file
+    struct file_awaiter {
+        http_conn* conn;
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> handle);
+        void await_resume() {}
+    };
 
+    // Body of the connection coroutine: read, parse, respond until the connection is closed
+    conn_task serve();
 
-    // Initialization before parsing request
+    static const uint32_t ET_OWNED = 1u << 31;
+    // What serve_et() leaves the connection in: waiting for an edge, to be closed, waiting for a cold file, or out of its write quantum
+    enum ET_RESULT {ET_IDLE, ET_CLOSE, ET_PARKED, ET_YIELD};
+    // Edge-triggered mode, on a worker: take the pending events and serve until the socket would block, then give the connection back
+    void process_et();
+    // Read, parse and write as long as the socket allows
+    ET_RESULT serve_et();
+    // Remove n bytes that have been written from the front of m_iv
+    void consume_iov(int n);
+    // Send the next part of the response with one system call: writev() of the headers and a mapped file,
+    // or a sendfile() chunk of a streamed file. Returns the bytes sent, -1 with errno set.
+    ssize_t send_part();
+
+    // Initialization before parsing request, once the response has been sent. Pipelined bytes are kept.
     void init();
+    // Reset the state of the request, parsing goes on from the end of the previous one
+    void next_request();
+    // While complete requests follow in the read buffer, append their responses to the pending output
+    void batch_pipelined();
+    // The pending output was written: count its responses
+    void count_responses();
+    // Whether the buffer holds another complete GET request that is answered from a file (no proxy, no upgrade, no body)
+    bool pipelined_request_ready();
     // Parse HTTP request
     HTTP_CODE process_read(); 
     // The following set of functions are called by process_read to analyze HTTP requests
@@ -144,19 +289,38 @@ private:
     // Get the actual current of line <Parse before Get>
     char* get_line() {return m_read_buf + m_start_line;}
     HTTP_CODE do_request();
+    // Forward the request to the upstream of m_route, which streams its response to the client
+    HTTP_CODE do_proxy();
     // Release memory map
     void unmap();
+    // Point the response at the loaded file, or turn it into an error response if loading failed
+    bool file_loaded();
+    // Called by the file cache when a cold file has been loaded
+    static void file_ready(void* arg);
+
+    // Switch the connection to HTTP/2 and hand it the bytes already read. Returns false if the upgrade is invalid.
+    bool start_h2();
+    // Read and write the socket of an HTTP/2 connection until it would block; *interest is the event to wait for next.
+    // Returns false once the connection should be closed.
+    bool h2_run(uint32_t* interest);
+    // Resolver of the HTTP/2 streams, the same lookup as do_request()
+    static void h2_resolve(void* arg, const h2_request& request, h2_response* response);
+    static void h2_release(void* file);
 
 
-    // Generate response
+    // Generate response, and the responses of the pipelined requests after it
     bool process_write(HTTP_CODE ret);
+    // Append the response to the pending output
+    bool build_response(HTTP_CODE ret);
+    // Append a range to m_iv, merged with the previous one when they are contiguous
+    void add_iov(char* base, size_t len);
     // The following set of functions are called by process_write to generate HTTP response
     bool add_response(const char* format, ...);
     bool add_content(const char* content);
     bool add_content_type();
     bool add_status_line(int status, const char* title);
-    bool add_headers(int content_length);
-    bool add_content_length(int content_length);
+    bool add_headers(off_t content_length);
+    bool add_content_length(off_t content_length);
     bool add_linger();
     bool add_blank_line();
     
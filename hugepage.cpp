@@ -0,0 +1,114 @@
+#include "hugepage.h"
+#include "membudget.h"
+#include <sys/mman.h>
+#include <stdint.h>
+#include <atomic>
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+namespace {
+
+std::atomic<size_t> hugetlb_bytes(0);
+std::atomic<size_t> thp_bytes(0);
+std::atomic<size_t> small_bytes(0);
+
+size_t round_up(size_t bytes) {
+    return (bytes + huge_pages::HUGE_PAGE_SIZE - 1) / huge_pages::HUGE_PAGE_SIZE * huge_pages::HUGE_PAGE_SIZE;
+}
+
+}
+
+void* huge_pages::alloc(size_t bytes) {
+    bytes = round_up(bytes);
+
+    // 1. Reserved huge pages: fails right away when there are not enough of them
+    void* address = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (address != MAP_FAILED) {
+        hugetlb_bytes += bytes;
+        return address;
+    }
+
+    // 2. Transparent huge pages need a 2 MB aligned range: map one page more and trim both ends
+    char* raw = (char*)mmap(0, bytes + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char* aligned = (char*)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    munmap(aligned + bytes, raw + HUGE_PAGE_SIZE - aligned);
+
+    if (madvise(aligned, bytes, MADV_HUGEPAGE) == 0) {
+        thp_bytes += bytes;
+    } else {
+        small_bytes += bytes;
+    }
+    return aligned;
+}
+
+void huge_pages::free(void* address, size_t bytes) {
+    if (address) {
+        munmap(address, round_up(bytes));
+    }
+}
+
+void huge_pages::dump_stats(FILE* fp) {
+    fprintf(fp, "huge pages: %zu MB explicit, %zu MB transparent, %zu MB small pages\n",
+        hugetlb_bytes.load() >> 20, thp_bytes.load() >> 20, small_bytes.load() >> 20);
+}
+
+buffer_pool::buffer_pool(size_t block_size)
+    : m_block_size((block_size + 63) / 64 * 64), m_free(NULL), m_used(0), m_total(0) {
+}
+
+char* buffer_pool::get() {
+    m_lock.lock();
+    if (!m_free) {
+        // Grow by one huge page, never shrink: a peak of connections is likely to come back.
+        // Over the memory budget the pool doesn't grow, and the caller refuses the connection.
+        if (!memory_budget::try_charge(memory_budget::BUFFERS, huge_pages::HUGE_PAGE_SIZE)) {
+            m_lock.unlock();
+            return NULL;
+        }
+        char* chunk = (char*)huge_pages::alloc(huge_pages::HUGE_PAGE_SIZE);
+        if (!chunk) {
+            memory_budget::uncharge(memory_budget::BUFFERS, huge_pages::HUGE_PAGE_SIZE);
+            m_lock.unlock();
+            return NULL;
+        }
+        size_t count = huge_pages::HUGE_PAGE_SIZE / m_block_size;
+        // Pushed in reverse, so the chunk is handed out from its start
+        for (size_t i = count; i > 0; --i) {
+            free_block* block = (free_block*)(chunk + (i - 1) * m_block_size);
+            block->next = m_free;
+            m_free = block;
+        }
+        m_total += count;
+    }
+    free_block* block = m_free;
+    m_free = block->next;
+    m_used ++;
+    m_lock.unlock();
+    return (char*)block;
+}
+
+void buffer_pool::dump_stats(FILE* fp, const char* name) {
+    m_lock.lock();
+    fprintf(fp, "%s: %zu of %zu blocks of %zu bytes in use\n", name, m_used, m_total, m_block_size);
+    m_lock.unlock();
+}
+
+void buffer_pool::put(char* block) {
+    if (!block) {
+        return;
+    }
+    m_lock.lock();
+    free_block* b = (free_block*)block;
+    b->next = m_free;
+    m_free = b;
+    m_used --;
+    m_lock.unlock();
+}
@@ -0,0 +1,52 @@
+// Memory backed by 2 MB pages, for the connection table and the I/O buffers
+#ifndef HUGEPAGE_H
+#define HUGEPAGE_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include "locker.h"
+
+/*
+    With 4 KB pages, touching a few fields of thousands of connections spread over a large table needs a TLB entry per page.
+    Memory from here is mapped with 2 MB pages:
+        - Explicit huge pages (MAP_HUGETLB) when the system has reserved some (vm.nr_hugepages);
+        - Otherwise a 2 MB aligned mapping marked MADV_HUGEPAGE, so transparent huge pages back it;
+        - Otherwise (THP disabled) plain pages, the memory still works.
+*/
+class huge_pages {
+public:
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    // Allocate zeroed memory, rounded up to whole huge pages. NULL if out of memory.
+    static void* alloc(size_t bytes);
+    static void free(void* address, size_t bytes);
+    // Bytes mapped with each kind of backing
+    static void dump_stats(FILE* fp);
+};
+
+// Fixed-size blocks carved from huge pages, reused most recently freed first so busy buffers stay in the cache
+class buffer_pool {
+public:
+    // block_size is rounded up to a cache line
+    buffer_pool(size_t block_size);
+
+    // A free block, NULL if out of memory or over the memory budget
+    char* get();
+    void put(char* block);
+    size_t block_size() const { return m_block_size; }
+    void dump_stats(FILE* fp, const char* name);
+
+private:
+    struct free_block {
+        free_block* next;
+    };
+
+    locker m_lock;
+    size_t m_block_size;
+    free_block* m_free;
+    // Blocks handed out and blocks allocated, for the stats
+    size_t m_used;
+    size_t m_total;
+};
+
+#endif
@@ -23,13 +23,49 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <time.h>
 #include "locker.h"
 #include "threadpool.h"
 #include <signal.h>
 #include "http_conn.h"
+#include "file_cache.h"
+#include "trace.h"
+#include "proxy.h"
+#include "ratelimit.h"
+#include "pack.h"
+#include "warmup.h"
+#include "busypoll.h"
+#include "hugepage.h"
+#include "capture.h"
+#include "prefork.h"
+#include "membudget.h"
+#include "probes.h"
+#include "vhost.h"
+#include <new>
+#include <vector>
 
 #define MAX_FD 65536  // Maximum number of file descriptors
 #define MAX_EVENT_NUMBER 10000 // Maximum number of listen events
+#define DRAIN_TIMEOUT 10 // Seconds to wait for open connections on shutdown
+#define HOT_SET_INTERVAL 60 // Seconds between two saves of the hot set
+#define DEFER_INTERVAL 10 // Milliseconds between two retries of the reads deferred over the memory budget
+
+// Set by signal handlers, handled by the main loop
+static volatile sig_atomic_t stop_server = 0;
+static volatile sig_atomic_t dump_status = 0;
+static volatile sig_atomic_t dump_trace = 0;
+
+void stop_handler(int) {
+    stop_server = 1;
+}
+
+void status_handler(int) {
+    dump_status = 1;
+}
+
+void trace_handler(int) {
+    dump_trace = 1;
+}
 
 // Capture Signal 
 void addsig(int sig, void(handler)(int)) {
@@ -47,39 +83,42 @@ extern void addfd(int epollfd, int fd, bool one_shot);
 extern void removefd(int epollfd, int fd);
 // Modify fd
 extern void modfd(int epollfd, int fd, int ev);
+extern void setnonblocking(int fd);
+// Server root dir
+extern const char* doc_root;
 
-// Run the program with port number
-int main(int argc, char* argv[]) {
-    
-    if(argc <= 1) {
-        // basename: extracts the base name of the path of program
-        printf("Please use the following command to run the program: %s port_number\n", basename(argv[0]));
-        exit(-1);
-    }
-
-    // 1. Get port number
-    int port = atoi(argv[1]);
-
-    // 2. If one ends the connection while the other still tries to write data in network programming, a SIGPIPE error will occur. Thus, SIGPIPE must be processed.
-    addsig(SIGPIPE, SIG_IGN);
-
-    // 3. Create and initiate thread pool
-    // Task: When a client connects, the client may send HTTP request
-    threadpool<http_conn>* pool = nullptr;
-    try {
-        pool = new threadpool<http_conn>;
-
-    } catch(...) { // catch any exception thrown in a try block
-        exit(-1);
-    }
-
-    // 4. Save all clients' info
-    http_conn* users = new http_conn[MAX_FD];
+void usage(const char* prog) {
+    // basename: extracts the base name of the path of program
+    printf("Please use the following command to run the program: %s [options] port_number\n", basename(prog));
+    printf("    -r    document root (default %s)\n", doc_root);
+    printf("    -V    virtual host: requests with this Host header are served from root, host=root[:MB] with its own cache of MB (repeatable)\n");
+    printf("    -a    serve the files of an archive built by tools/pack instead of the document root\n");
+    printf("    -c    handle every connection as a C++20 coroutine\n");
+    printf("    -e    edge-triggered epoll: register sockets once and hand connections to workers with an atomic flag\n");
+    printf("    -t    minimum number of worker threads (default 8)\n");
+    printf("    -T    maximum number of worker threads (default 4 x minimum)\n");
+    printf("    -m    size of the file cache in MB (default 64)\n");
+    printf("    -M    memory budget in MB for connections, buffers, file mappings and HTTP/2 sessions (default no limit, split between -P workers)\n");
+    printf("    -w    hot-set file: warm the file cache from it at startup and save the most requested files to it every minute\n");
+    printf("    -W    warming budget, seconds[:MB] (default 30 seconds, the size of the file cache)\n");
+    printf("    -i    number of threads loading cold files from disk (default 2, 0 loads them on the worker)\n");
+    printf("    -p    forward URLs starting with prefix to an upstream, prefix=ip:port (repeatable)\n");
+    printf("    -l    maximum number of connections per client IP (default no limit)\n");
+    printf("    -q    requests per second per client IP, rate[:burst] (default no limit)\n");
+    printf("    -b    busy-poll: spin on epoll for up to N microseconds before sleeping (default 0, always sleep)\n");
+    printf("    -B    SO_BUSY_POLL of client sockets in microseconds (default 0, may need CAP_NET_ADMIN)\n");
+    printf("    -s    trace one request out of every N, SIGUSR1 writes the trace file\n");
+    printf("    -o    trace file in Chrome trace-event format (default trace.json)\n");
+    printf("    -P    prefork N worker processes under a master that restarts them; SIGUSR2 to the master prints all counters\n");
+    printf("    -R    with -P, one SO_REUSEPORT listening socket per worker instead of a shared one\n");
+    printf("    -k    capture the traffic of one connection out of every N to a file for tools/replay, file[:N] (default N 1)\n");
+}
 
-    // 5. Socket programming
+// Socket, bind and listen on port; reuse_port lets every prefork worker have its own socket
+static int open_listener(int port, bool reuse_port) {
     // 5.1 Socket creation
     int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    
+
     if(listenfd == -1) {
         perror("socket");
         return -1;
@@ -88,6 +127,9 @@ int main(int argc, char* argv[]) {
     // 5.2 port multiplexing
     int reuse = 1;
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if(reuse_port) {
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
 
     // 5.3 bind ip and port
     struct sockaddr_in address;
@@ -98,6 +140,7 @@ int main(int argc, char* argv[]) {
 
     if(ret == -1) {
         perror("bind");
+        close(listenfd);
         return -1;
     }
 
@@ -105,6 +148,226 @@ int main(int argc, char* argv[]) {
     ret = listen(listenfd, 5);
     if(ret == -1) {
         perror("listen");
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+// Run the program with port number
+int main(int argc, char* argv[]) {
+
+    // 1. Get options and port number
+    int cache_mb = 64;
+    int budget_mb = 0;
+    int io_threads = 2;
+    int min_threads = 8;
+    int max_threads = 0;
+    const char* trace_file = "trace.json";
+    const char* archive = NULL;
+    const char* hot_set = NULL;
+    int warm_seconds = 30, warm_mb = 0;
+    int spin_us = 0, busy_poll_us = 0;
+    int conn_limit = 0;
+    double request_rate = 0, request_burst = 0;
+    const char* capture_file = NULL;
+    int capture_rate = 1;
+    int workers = 0;
+    bool reuse_port = false;
+    int opt;
+    while((opt = getopt(argc, argv, "r:V:a:cem:M:i:w:W:t:T:s:o:p:l:q:b:B:k:P:R")) != -1) {
+        switch(opt) {
+            case 'r':
+                doc_root = optarg;
+                break;
+            case 'V':
+                if(!vhost_table::add(optarg)) {
+                    printf("Invalid virtual host: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'a':
+                archive = optarg;
+                break;
+            case 'c':
+                http_conn::m_use_coroutines = true;
+                break;
+            case 'e':
+                http_conn::m_edge_triggered = true;
+                break;
+            case 't':
+                min_threads = atoi(optarg);
+                break;
+            case 'T':
+                max_threads = atoi(optarg);
+                break;
+            case 'm':
+                cache_mb = atoi(optarg);
+                break;
+            case 'M':
+                budget_mb = atoi(optarg);
+                break;
+            case 'i':
+                io_threads = atoi(optarg);
+                break;
+            case 'w':
+                hot_set = optarg;
+                break;
+            case 'W':
+                if(sscanf(optarg, "%d:%d", &warm_seconds, &warm_mb) < 1) {
+                    printf("Invalid warming budget: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'b':
+                spin_us = atoi(optarg);
+                break;
+            case 'B':
+                busy_poll_us = atoi(optarg);
+                break;
+            case 's':
+                tracer::enable(atoi(optarg));
+                break;
+            case 'o':
+                trace_file = optarg;
+                break;
+            case 'p':
+                if(!proxy::add_route(optarg)) {
+                    printf("Invalid proxy route: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'k': {
+                // file[:N], the rate only if what follows the last colon is a number
+                capture_file = optarg;
+                char* colon = strrchr(optarg, ':');
+                if(colon && colon[1] && strspn(colon + 1, "0123456789") == strlen(colon + 1)) {
+                    *colon = '\0';
+                    capture_rate = atoi(colon + 1);
+                }
+                break;
+            }
+            case 'P':
+                workers = atoi(optarg);
+                break;
+            case 'R':
+                reuse_port = true;
+                break;
+            case 'l':
+                conn_limit = atoi(optarg);
+                break;
+            case 'q':
+                if(sscanf(optarg, "%lf:%lf", &request_rate, &request_burst) < 1) {
+                    printf("Invalid request rate: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(-1);
+        }
+    }
+
+    if(optind >= argc) {
+        usage(argv[0]);
+        exit(-1);
+    }
+    if(archive && vhost_table::count() > 0) {
+        printf("-a and -V can't be combined: an archive replaces every document root\n");
+        exit(-1);
+    }
+    if(http_conn::m_edge_triggered && http_conn::m_use_coroutines) {
+        printf("-e and -c can't be combined: coroutines re-arm their socket for every wait\n");
+        exit(-1);
+    }
+    int port = atoi(argv[optind]);
+    rate_limiter::configure(conn_limit, request_rate, request_burst);
+
+    // 1.1 Prefork: the master stays in prefork::run(), every worker continues from here with its own threads and caches
+    int listenfd = -1;
+    if(workers > 0) {
+        if(!reuse_port && (listenfd = open_listener(port, false)) < 0) {
+            return -1;
+        }
+        int index = prefork::run(workers, listenfd);
+        printf("Worker %d running, pid %d\n", index, getpid());
+        // Files written by the server get the worker index as a suffix
+        static char paths[3][1024];
+        if(capture_file) {
+            snprintf(paths[0], sizeof(paths[0]), "%s.%d", capture_file, index);
+            capture_file = paths[0];
+        }
+        if(hot_set) {
+            snprintf(paths[1], sizeof(paths[1]), "%s.%d", hot_set, index);
+            hot_set = paths[1];
+        }
+        snprintf(paths[2], sizeof(paths[2]), "%s.%d", trace_file, index);
+        trace_file = paths[2];
+        // The workers share the budget of the machine or container
+        if(budget_mb > 0) {
+            budget_mb = budget_mb > workers ? budget_mb / workers : 1;
+        }
+    }
+    memory_budget::configure((size_t)budget_mb * 1024 * 1024);
+    if(capture_file && !capture::start(capture_file, capture_rate)) {
+        exit(-1);
+    }
+
+    // 2. If one ends the connection while the other still tries to write data in network programming, a SIGPIPE error will occur. Thus, SIGPIPE must be processed.
+    addsig(SIGPIPE, SIG_IGN);
+    // SIGTERM/SIGINT: graceful shutdown; SIGUSR1: write the trace file; SIGUSR2: print the server state
+    addsig(SIGTERM, stop_handler);
+    addsig(SIGINT, stop_handler);
+    addsig(SIGUSR1, trace_handler);
+    addsig(SIGUSR2, status_handler);
+
+    // 3. Create and initiate thread pool
+    // Task: When a client connects, the client may send HTTP request
+    threadpool<http_conn>* pool = nullptr;
+    try {
+        if(max_threads <= 0) {
+            max_threads = 4 * min_threads;
+        }
+        pool = new threadpool<http_conn>(min_threads, max_threads);
+        file_cache::start_loaders(io_threads);
+
+    } catch(...) { // catch any exception thrown in a try block
+        exit(-1);
+    }
+    http_conn::m_pool = pool;
+    // -m is shared by the virtual hosts, each evicts only from its own slice
+    vhost_table::start(doc_root, (size_t)cache_mb * 1024 * 1024);
+    if(archive) {
+        http_conn::m_pack = new pack();
+        if(!http_conn::m_pack->open(archive)) {
+            exit(-1);
+        }
+        printf("Serving %u files from %s\n", http_conn::m_pack->count(), archive);
+    }
+    // Warming runs in the background, the server accepts traffic meanwhile
+    if(hot_set && !archive) {
+        if(warm_mb <= 0) {
+            warm_mb = cache_mb;
+        }
+        cache_warmer::start(hot_set, HOT_SET_INTERVAL, warm_seconds, (size_t)warm_mb * 1024 * 1024);
+    }
+
+    // 4. Save all clients' info, in huge pages: events hit random entries of the table
+    http_conn* users = (http_conn*)huge_pages::alloc(sizeof(http_conn) * MAX_FD);
+    if(!users) {
+        printf("Out of memory for the connection table\n");
+        exit(-1);
+    }
+    if(!memory_budget::try_charge(memory_budget::CONNECTIONS, sizeof(http_conn) * MAX_FD)) {
+        printf("The memory budget is smaller than the connection table (%zu MB)\n", sizeof(http_conn) * MAX_FD >> 20);
+        exit(-1);
+    }
+    for(int i = 0; i < MAX_FD; i++) {
+        new (users + i) http_conn();
+    }
+
+    // 5. Socket programming: the listening socket, unless a prefork worker shares the master's
+    if(listenfd == -1 && (listenfd = open_listener(port, reuse_port)) < 0) {
         return -1;
     }
 
@@ -112,12 +375,46 @@ int main(int argc, char* argv[]) {
     epoll_event events[MAX_EVENT_NUMBER];
     int epollfd = epoll_create(5);
     // 5.5.2 Add the monitoring file descriptor to the epoll instance
-    addfd(epollfd, listenfd, false);
+    epoll_event listen_event;
+    listen_event.events = EPOLLIN;
+    // Workers sharing one socket: a connection wakes up only one of them
+    if(workers > 0 && !reuse_port) {
+        listen_event.events |= EPOLLEXCLUSIVE;
+    }
+    if(http_conn::m_edge_triggered) {
+        // Connections are reached through data.ptr, the listening socket is the one without
+        listen_event.data.ptr = NULL;
+    } else {
+        listen_event.data.fd = listenfd;
+    }
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &listen_event);
+    setnonblocking(listenfd);
     http_conn::m_epollfd = epollfd;
+    busy_poller poller(spin_us, busy_poll_us);
+
+    // Read the request of a connection and hand it to a worker
+    auto read_request = [&](int sockfd) {
+        // Read all data at one time
+        if(users[sockfd].read()) {
+            TRACE_STAGE(users[sockfd].trace_id(), ENQUEUE, sockfd);
+            pool->append(users + sockfd);
+        } else {
+            users[sockfd].close_conn();
+        }
+    };
+    // Connections left unread over the memory budget, their sockets aren't armed until they are read
+    std::vector<int> deferred;
 
     // 5.5.3 Detect events
+    bool draining = false;
+    time_t drain_deadline = 0;
     while(true) {
-        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        // While draining, wake up regularly to check whether all connections are gone; retry the deferred reads
+        int timeout = draining ? 100 : -1;
+        if(!deferred.empty()) {
+            timeout = DEFER_INTERVAL;
+        }
+        int num = poller.wait(epollfd, events, MAX_EVENT_NUMBER, timeout);
         if((num < 0) && (errno != EINTR)) {
             printf("epoll failed\n");
             break;
@@ -125,9 +422,10 @@ int main(int argc, char* argv[]) {
 
         // 5.5.4 Process events events
         for(int i = 0; i < num; i++) {
-            int sockfd = events[i].data.fd;
-            
-            if(sockfd == listenfd) { // Client connection
+            bool edge_triggered = http_conn::m_edge_triggered;
+            int sockfd = edge_triggered ? -1 : events[i].data.fd;
+
+            if(edge_triggered ? events[i].data.ptr == NULL : sockfd == listenfd) { // Client connection
                 struct sockaddr_in client_address;
                 socklen_t client_addrlength = sizeof(client_address);
                 int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_addrlength);
@@ -136,27 +434,57 @@ int main(int argc, char* argv[]) {
                     printf("errno is: %d\n", errno);
                     continue;
                 } 
+                PROBE3(accept, connfd, ntohl(client_address.sin_addr.s_addr), ntohs(client_address.sin_port));
 
                 if(http_conn::m_user_count >= MAX_FD) {
                     // The current number of connections is full, write a message to the client: the server is busy
                     close(connfd);
                     continue;
                 }
+
+                // Over the memory budget, a new connection would only add to the memory in use
+                if(memory_budget::over_budget()) {
+                    memory_budget::refuse_connection();
+                    close(connfd);
+                    continue;
+                }
                 
+                // Clients over their connection cap are dropped before any work is done for them
+                client_state* limit;
+                if(!rate_limiter::open_connection(client_address.sin_addr.s_addr, &limit)) {
+                    close(connfd);
+                    continue;
+                }
+
+                poller.setup_socket(connfd);
+
                 // Initialize new clients' data 
-                users[connfd].init(connfd, client_address);
+                users[connfd].init(connfd, client_address, limit);
+                prefork::count_accept();
+
+            } else if(edge_triggered) { // Straight to the connection object, no fd lookup and no re-arming
+                ((http_conn*)events[i].data.ptr)->notify(events[i].events);
+
+            } else if(http_conn::m_use_coroutines) { // The connection coroutine handles errors, reads and writes itself
+                users[sockfd].resume(events[i].events);
 
             } else if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) { // The other party is abnormally disconnected or has errors, etc.
                 // close connection
                 users[sockfd].close_conn();
 
-            } else if(events[i].events & EPOLLIN) { // Read event
-                // Read all data at one time
-                if(users[sockfd].read()) {
-                    pool->append(users + sockfd);
-                } else {
+            } else if(users[sockfd].is_h2()) { // HTTP/2 reads and writes on the worker thread, whatever the event
+                if(!pool->append(users + sockfd)) {
                     users[sockfd].close_conn();
                 }
+
+            } else if(events[i].events & EPOLLIN) { // Read event
+                // Over the memory budget a new request waits in the socket, its client is slowed down by TCP flow control
+                if(!draining && memory_budget::over_budget()) {
+                    memory_budget::defer_read();
+                    deferred.push_back(sockfd);
+                    continue;
+                }
+                read_request(sockfd);
             } else if(events[i].events & EPOLLOUT) { // Write event
                 // Write all data at one time
                 if(!users[sockfd].write()) {
@@ -166,11 +494,72 @@ int main(int argc, char* argv[]) {
             }
 
         }
+
+        // The responses in flight have released enough memory, or the server is shutting down
+        if(!deferred.empty() && (draining || !memory_budget::over_budget())) {
+            for(int sockfd : deferred) {
+                read_request(sockfd);
+            }
+            deferred.clear();
+        }
+
+        if(dump_trace) {
+            dump_trace = 0;
+            tracer::dump(trace_file);
+        }
+
+        if(dump_status) {
+            dump_status = 0;
+            pool_stats ps = pool->stats();
+            printf("connections: %d\n", http_conn::m_user_count.load());
+            printf("threadpool: %d threads (min %d, max %d), %d busy, %d idle, %d queued, %lu completed, %lu rejected, %lu spawned, %lu retired\n",
+                ps.threads, ps.min_threads, ps.max_threads, ps.busy, ps.idle, ps.queued, ps.completed, ps.rejected, ps.spawned, ps.retired);
+            proxy::dump_stats(stdout);
+            rate_limiter::dump_stats(stdout);
+            http_conn::dump_output_stats(stdout);
+            h2_session::dump_stats(stdout);
+            capture::dump_stats(stdout);
+            poller.dump_stats(stdout);
+            huge_pages::dump_stats(stdout);
+            http_conn::m_buffers.dump_stats(stdout, "connection buffers");
+            memory_budget::dump_stats(stdout);
+            vhost_table::dump_stats(stdout);
+        }
+
+        // 5.5.5 Graceful shutdown: stop accepting, let the open connections finish their responses
+        if(stop_server && !draining) {
+            printf("Shutting down, waiting for %d connections\n", http_conn::m_user_count.load());
+            draining = true;
+            drain_deadline = time(NULL) + DRAIN_TIMEOUT;
+            http_conn::m_draining = true;
+            removefd(epollfd, listenfd);
+            listenfd = -1;
+            // Only the responses in flight are waited for
+            for(int i = 0; i < MAX_FD; i++) {
+                users[i].drain_idle();
+            }
+        }
+        if(draining && (http_conn::m_user_count == 0 || time(NULL) >= drain_deadline)) {
+            break;
+        }
     }
 
+    // Finish the requests already handed to the thread pool before anything is freed
+    pool->drain();
     close(epollfd);
-    close(listenfd);
-    delete []users;
+    if(listenfd != -1) {
+        close(listenfd);
+    }
+    for(int i = 0; i < MAX_FD; i++) {
+        users[i].~http_conn();
+    }
+    huge_pages::free(users, sizeof(http_conn) * MAX_FD);
     delete pool;
+    cache_warmer::stop();
+    capture::stop();
+    // Loads still running after a drain that timed out refer to the caches
+    file_cache::stop_loaders();
+    vhost_table::stop();
+    delete http_conn::m_pack;
     return 0;
 }
\ No newline at end of file
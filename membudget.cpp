@@ -0,0 +1,127 @@
+#include "membudget.h"
+#include "locker.h"
+#include <vector>
+
+size_t memory_budget::m_limit = 0;
+size_t memory_budget::m_pressure = 0;
+std::atomic<size_t> memory_budget::m_used(0);
+std::atomic<unsigned long> memory_budget::m_refused_connections(0);
+std::atomic<unsigned long> memory_budget::m_deferred_reads(0);
+
+namespace {
+
+const char* account_names[memory_budget::ACCOUNT_COUNT] = {"connections", "buffers", "file cache", "http2"};
+
+struct reclaimer {
+    size_t (*reclaim)(void*, size_t);
+    void* arg;
+};
+
+std::atomic<size_t> account_used[memory_budget::ACCOUNT_COUNT];
+std::atomic<size_t> peak(0);
+std::atomic<unsigned long> refused_charges(0);
+std::atomic<unsigned long> reclaims(0);
+std::atomic<size_t> reclaimed(0);
+
+// Held while the reclaimers run, one thread reclaims for all
+locker reclaim_lock;
+std::vector<reclaimer> reclaimers;
+
+double mb(size_t bytes) {
+    return bytes / (1024.0 * 1024.0);
+}
+
+void note_peak(size_t used) {
+    size_t old = peak.load(std::memory_order_relaxed);
+    while (used > old && !peak.compare_exchange_weak(old, used, std::memory_order_relaxed)) {
+    }
+}
+
+// Ask the reclaimers for wanted bytes, in the order they registered
+void reclaim(size_t wanted) {
+    reclaim_lock.lock();
+    size_t freed = 0;
+    for (size_t i = 0; i < reclaimers.size() && freed < wanted; ++i) {
+        freed += reclaimers[i].reclaim(reclaimers[i].arg, wanted - freed);
+    }
+    reclaim_lock.unlock();
+    reclaims ++;
+    reclaimed += freed;
+}
+
+}
+
+void memory_budget::configure(size_t limit) {
+    m_limit = limit;
+    m_pressure = limit - limit / 8;
+}
+
+void memory_budget::charge(ACCOUNT account, size_t bytes) {
+    account_used[account] += bytes;
+    note_peak(m_used += bytes);
+}
+
+bool memory_budget::try_charge(ACCOUNT account, size_t bytes) {
+    if (m_limit) {
+        size_t used = m_used.load(std::memory_order_relaxed);
+        if (used + bytes > m_pressure) {
+            reclaim(used + bytes - m_pressure);
+        }
+        // Reserve the bytes only if they fit, concurrent charges can't overshoot together
+        used = m_used.load(std::memory_order_relaxed);
+        do {
+            if (used + bytes > m_limit) {
+                refused_charges ++;
+                return false;
+            }
+        } while (!m_used.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+        account_used[account] += bytes;
+        note_peak(used + bytes);
+        return true;
+    }
+    charge(account, bytes);
+    return true;
+}
+
+void memory_budget::uncharge(ACCOUNT account, size_t bytes) {
+    account_used[account] -= bytes;
+    m_used -= bytes;
+}
+
+void memory_budget::add_reclaimer(size_t (*reclaim)(void*, size_t), void* arg) {
+    reclaim_lock.lock();
+    reclaimers.push_back({reclaim, arg});
+    reclaim_lock.unlock();
+}
+
+void memory_budget::remove_reclaimer(void* arg) {
+    reclaim_lock.lock();
+    for (size_t i = 0; i < reclaimers.size(); ++i) {
+        if (reclaimers[i].arg == arg) {
+            reclaimers.erase(reclaimers.begin() + i);
+            break;
+        }
+    }
+    reclaim_lock.unlock();
+}
+
+bool memory_budget::relieve() {
+    size_t used = m_used.load(std::memory_order_relaxed);
+    if (used > m_pressure) {
+        reclaim(used - m_pressure);
+    }
+    return m_used.load(std::memory_order_relaxed) <= m_pressure;
+}
+
+void memory_budget::dump_stats(FILE* fp) {
+    if (m_limit) {
+        fprintf(fp, "memory: %.1f MB of %.1f MB budget used (peak %.1f MB)", mb(m_used.load()), mb(m_limit), mb(peak.load()));
+    } else {
+        fprintf(fp, "memory: %.1f MB used, no budget (peak %.1f MB)", mb(m_used.load()), mb(peak.load()));
+    }
+    for (int i = 0; i < ACCOUNT_COUNT; ++i) {
+        fprintf(fp, ", %s %.1f MB", account_names[i], mb(account_used[i].load()));
+    }
+    fprintf(fp, "\nmemory pressure: %lu reclaims freed %.1f MB, %lu charges refused, %lu connections refused, %lu reads deferred\n",
+        reclaims.load(), mb(reclaimed.load()), refused_charges.load(), m_refused_connections.load(), m_deferred_reads.load());
+}
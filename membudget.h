@@ -0,0 +1,61 @@
+// Global memory budget: the subsystems whose memory grows with the load charge it to one account
+#ifndef MEMBUDGET_H
+#define MEMBUDGET_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <atomic>
+
+/*
+    Every allocation that grows with the traffic is charged here: the connection table, the chunks of the buffer pools,
+    the mappings of the file caches and the HTTP/2 sessions. With a budget (-M):
+        - Above the pressure mark (7/8 of the budget), the reclaimers registered by the caches free what no connection uses;
+        - A charge that still doesn't fit is refused, and the caller does without the memory: the file cache streams
+          the file instead of mapping it, the buffer pool refuses the connection, HTTP/2 is refused;
+        - While over the pressure mark, the main thread refuses new connections and leaves idle connections unread,
+          so clients back off through TCP flow control until responses in flight have released their memory.
+    Without a budget the charges are only counted, for the stats.
+*/
+class memory_budget {
+public:
+    enum ACCOUNT {CONNECTIONS = 0, BUFFERS, FILE_CACHE, HTTP2, ACCOUNT_COUNT};
+
+    // Hard budget in bytes, 0 for no limit
+    static void configure(size_t limit);
+    // Charge memory that is allocated whatever the budget says
+    static void charge(ACCOUNT account, size_t bytes);
+    // Charge memory only if it fits the budget, after reclaiming. false: the memory mustn't be allocated
+    static bool try_charge(ACCOUNT account, size_t bytes);
+    static void uncharge(ACCOUNT account, size_t bytes);
+
+    // reclaim(arg, wanted) frees up to wanted bytes of memory nobody uses and returns the bytes freed.
+    // It runs on the thread of a charge, which must not hold a lock the reclaimer takes.
+    static void add_reclaimer(size_t (*reclaim)(void*, size_t), void* arg);
+    static void remove_reclaimer(void* arg);
+
+    // Whether new work must wait: over the pressure mark even after reclaiming
+    static bool over_budget() {
+        return m_limit && m_used.load(std::memory_order_relaxed) > m_pressure && !relieve();
+    }
+    // Counters of the backpressure applied by the main thread
+    static void refuse_connection() {
+        m_refused_connections.fetch_add(1, std::memory_order_relaxed);
+    }
+    static void defer_read() {
+        m_deferred_reads.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void dump_stats(FILE* fp);
+
+private:
+    // Run the reclaimers, true if the usage is back under the pressure mark
+    static bool relieve();
+
+    static size_t m_limit;
+    static size_t m_pressure;
+    static std::atomic<size_t> m_used;
+    static std::atomic<unsigned long> m_refused_connections;
+    static std::atomic<unsigned long> m_deferred_reads;
+};
+
+#endif
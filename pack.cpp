@@ -0,0 +1,93 @@
+#include "pack.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+pack::pack() : m_base(NULL), m_size(0), m_header(NULL), m_entries(NULL), m_buckets(NULL) {
+}
+
+pack::~pack() {
+    if (m_base) {
+        munmap(m_base, m_size);
+    }
+}
+
+bool pack::open(const char* path) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(pack_header)) {
+        printf("%s: not a pack archive\n", path);
+        close(fd);
+        return false;
+    }
+    char* base = (char*)mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    const pack_header* header = (const pack_header*)base;
+    uint64_t size = st.st_size;
+    if (memcmp(header->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0 || header->size != size
+        || header->buckets == 0 || (header->buckets & (header->buckets - 1)) != 0 || header->count > header->buckets / 2
+        || header->entries_offset > size || (uint64_t)header->count * sizeof(pack_entry) > size - header->entries_offset
+        || header->buckets_offset > size || (uint64_t)header->buckets * sizeof(uint32_t) > size - header->buckets_offset
+        || header->strings_offset > size) {
+        printf("%s: not a pack archive or truncated\n", path);
+        munmap(base, st.st_size);
+        return false;
+    }
+    // Every entry is served without further checks, so one that points outside the file rejects the archive
+    const pack_entry* entries = (const pack_entry*)(base + header->entries_offset);
+    const uint32_t* buckets = (const uint32_t*)(base + header->buckets_offset);
+    uint64_t strings = size - header->strings_offset;
+    for (uint32_t i = 0; i < header->count; ++i) {
+        const pack_entry& e = entries[i];
+        if (e.data_offset > size || e.size > size - e.data_offset
+            || e.url_offset > strings || e.url_len > strings - e.url_offset
+            || e.header_offset > strings || e.header_len > strings - e.header_offset
+            || memchr(e.etag, '\0', sizeof(e.etag)) == NULL) {
+            printf("%s: entry %u out of range\n", path, i);
+            munmap(base, st.st_size);
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header->buckets; ++i) {
+        if (buckets[i] > header->count) {
+            printf("%s: bucket %u out of range\n", path, i);
+            munmap(base, st.st_size);
+            return false;
+        }
+    }
+
+    m_base = base;
+    m_size = st.st_size;
+    m_header = header;
+    m_entries = entries;
+    m_buckets = buckets;
+    // The index is touched on every request, the payloads are paged in on demand
+    madvise(base, header->strings_offset, MADV_WILLNEED);
+    return true;
+}
+
+const pack_entry* pack::find(const char* url) const {
+    size_t len = strlen(url);
+    uint64_t hash = pack_hash(url, len);
+    uint32_t mask = m_header->buckets - 1;
+    const char* strings = m_base + m_header->strings_offset;
+    for (uint32_t i = hash & mask; m_buckets[i] != 0; i = (i + 1) & mask) {
+        const pack_entry* entry = &m_entries[m_buckets[i] - 1];
+        if (entry->hash == hash && entry->url_len == len && memcmp(strings + entry->url_offset, url, len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,74 @@
+// Packed document tree: a single archive built offline by tools/pack, served from one mmap
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+    Layout of an archive, all offsets are from the start of the file:
+        pack_header
+        pack_entry[count]           sorted by URL
+        uint32_t[buckets]           hash index: entry number + 1, 0 for an empty bucket, linear probing
+        strings                     URLs, then the precomputed header block of every entry
+        payloads                    each one starting on a page boundary, so it can be sent straight from the mapping
+    The archive is written to a temporary file and renamed, so a server never sees a half-written one.
+*/
+#define PACK_MAGIC "WSPACK1"
+
+struct pack_header {
+    char magic[8];
+    uint32_t count;
+    // Power of two, at least twice the count
+    uint32_t buckets;
+    uint64_t entries_offset;
+    uint64_t buckets_offset;
+    uint64_t strings_offset;
+    // Size of the whole archive, to detect a truncated file
+    uint64_t size;
+};
+
+struct pack_entry {
+    uint64_t hash;
+    uint64_t data_offset;
+    uint64_t size;
+    uint32_t url_offset;
+    uint32_t url_len;
+    // "Content-Length: ...\r\nContent-Type: ...\r\nETag: ...\r\n", without Connection and the blank line
+    uint32_t header_offset;
+    uint32_t header_len;
+    // Quoted, as sent in the ETag header and compared with If-None-Match
+    char etag[24];
+};
+
+// FNV-1a of the URL, shared by the tool and the server
+inline uint64_t pack_hash(const char* url, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)url[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+class pack {
+public:
+    pack();
+    ~pack();
+    // Map the archive and check its header, false with a message printed if it isn't usable
+    bool open(const char* path);
+    // Entry of the URL, NULL if it isn't in the archive
+    const pack_entry* find(const char* url) const;
+    char* data(const pack_entry* entry) const { return m_base + entry->data_offset; }
+    const char* headers(const pack_entry* entry) const { return m_base + m_header->strings_offset + entry->header_offset; }
+    uint32_t count() const { return m_header->count; }
+
+private:
+    char* m_base;
+    size_t m_size;
+    const pack_header* m_header;
+    const pack_entry* m_entries;
+    const uint32_t* m_buckets;
+};
+
+#endif
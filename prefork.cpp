@@ -0,0 +1,170 @@
+#include "prefork.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <new>
+
+worker_stats* prefork::m_self = NULL;
+
+namespace {
+
+volatile sig_atomic_t stopping = 0;
+volatile sig_atomic_t dumping = 0;
+worker_stats* slots = NULL;
+int slot_count = 0;
+
+void on_stop(int) {
+    stopping = 1;
+}
+
+void on_dump(int) {
+    dumping = 1;
+}
+
+// Without SA_RESTART, so that the signals interrupt waitpid()
+void handle(int sig, void (*handler)(int)) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sigfillset(&sa.sa_mask);
+    sigaction(sig, &sa, NULL);
+}
+
+// Returns true in the new worker
+bool spawn(int index) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return false;
+    }
+    if (pid == 0) {
+        // The worker installs its own handlers; it goes away with the master
+        handle(SIGTERM, SIG_DFL);
+        handle(SIGINT, SIG_DFL);
+        handle(SIGUSR2, SIG_DFL);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        prefork::m_self = &slots[index];
+        slots[index].pid = getpid();
+        slots[index].connections = 0;
+        slots[index].started = time(NULL);
+        return true;
+    }
+    slots[index].pid = pid;
+    return false;
+}
+
+void dump(FILE* fp) {
+    uint64_t accepted = 0, requests = 0, bytes = 0;
+    int connections = 0;
+    time_t now = time(NULL);
+    for (int i = 0; i < slot_count; ++i) {
+        worker_stats& s = slots[i];
+        fprintf(fp, "worker %d: pid %d, up %llds, %d connections, %llu accepted, %llu requests, %llu bytes, %u restarts\n",
+            i, s.pid.load(), (long long)(now - s.started), s.connections.load(), (unsigned long long)s.accepted.load(),
+            (unsigned long long)s.requests.load(), (unsigned long long)s.bytes.load(), s.restarts.load());
+        connections += s.connections;
+        accepted += s.accepted;
+        requests += s.requests;
+        bytes += s.bytes;
+    }
+    fprintf(fp, "all workers: %d connections, %llu accepted, %llu requests, %llu bytes\n",
+        connections, (unsigned long long)accepted, (unsigned long long)requests, (unsigned long long)bytes);
+    fflush(fp);
+}
+
+}
+
+int prefork::run(int workers, int listenfd) {
+    slot_count = workers;
+    void* p = mmap(NULL, sizeof(worker_stats) * workers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(-1);
+    }
+    slots = (worker_stats*)p;
+    for (int i = 0; i < workers; ++i) {
+        new (slots + i) worker_stats();
+    }
+
+    handle(SIGTERM, on_stop);
+    handle(SIGINT, on_stop);
+    handle(SIGUSR2, on_dump);
+    for (int i = 0; i < workers; ++i) {
+        if (spawn(i)) {
+            return i;
+        }
+    }
+    printf("Master %d running %d workers\n", getpid(), workers);
+    fflush(stdout);
+
+    while (!stopping) {
+        // A slot whose fork() failed stays empty: try it again every second, until it starts
+        bool pending = false;
+        for (int i = 0; i < workers; ++i) {
+            if (slots[i].pid == 0) {
+                if (spawn(i)) {
+                    return i;
+                }
+                pending = pending || slots[i].pid == 0;
+            }
+        }
+        int status;
+        pid_t pid;
+        if (pending) {
+            sleep(1);
+            pid = waitpid(-1, &status, WNOHANG);
+        } else {
+            pid = waitpid(-1, &status, 0);
+        }
+        if (dumping) {
+            dumping = 0;
+            dump(stdout);
+        }
+        if (pid <= 0 || stopping) {
+            continue;
+        }
+        for (int i = 0; i < workers; ++i) {
+            if (slots[i].pid != pid) {
+                continue;
+            }
+            if (WIFSIGNALED(status)) {
+                printf("Worker %d (pid %d) killed by signal %d, restarting\n", i, pid, WTERMSIG(status));
+            } else {
+                printf("Worker %d (pid %d) exited with status %d, restarting\n", i, pid, WEXITSTATUS(status));
+            }
+            fflush(stdout);
+            slots[i].pid = 0;
+            // A worker that can't start (bad option, port taken) would otherwise be forked in a tight loop
+            if (time(NULL) - slots[i].started < 1) {
+                sleep(1);
+            }
+            slots[i].restarts ++;
+            if (spawn(i)) {
+                return i;
+            }
+            break;
+        }
+    }
+
+    // Shutdown: stop accepting, then let every worker drain its connections
+    printf("Master shutting down\n");
+    if (listenfd >= 0) {
+        close(listenfd);
+    }
+    for (int i = 0; i < workers; ++i) {
+        if (slots[i].pid > 0) {
+            kill(slots[i].pid, SIGTERM);
+        }
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {
+    }
+    dump(stdout);
+    exit(0);
+}
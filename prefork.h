@@ -0,0 +1,59 @@
+// Prefork mode: a master process supervising worker processes, each a complete threaded server
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+    Counters of one worker, in a shared-memory page the master reads.
+    Each worker only writes its own slot (relaxed atomics, no locks), on its own cache line.
+    A restarted worker takes over the slot of the dead one and keeps adding to its totals.
+*/
+struct alignas(64) worker_stats {
+    // 0 while the slot has no running worker
+    std::atomic<int> pid;
+    std::atomic<int> connections;
+    std::atomic<uint32_t> restarts;
+    std::atomic<int64_t> started;
+    std::atomic<uint64_t> accepted;
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> bytes;
+};
+
+class prefork {
+public:
+    /*
+        Fork workers and keep them running: a dead worker is forked again, after a pause if it died right after starting.
+        Returns only in a worker, with its index. The master exits on SIGTERM/SIGINT once the workers have drained,
+        and prints the counters of all workers on SIGUSR2. listenfd is the socket shared by the workers, -1 if they
+        open their own (SO_REUSEPORT).
+    */
+    static int run(int workers, int listenfd);
+
+    static void count_accept() {
+        if (m_self) {
+            m_self->accepted.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    static void count_request() {
+        if (m_self) {
+            m_self->requests.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    static void count_bytes(int64_t n) {
+        if (m_self) {
+            m_self->bytes.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+    static void set_connections(int n) {
+        if (m_self) {
+            m_self->connections.store(n, std::memory_order_relaxed);
+        }
+    }
+
+    // Slot of this worker, NULL when the server isn't preforked
+    static worker_stats* m_self;
+};
+
+#endif
@@ -0,0 +1,73 @@
+// USDT probes of the request lifecycle, for perf and bpftrace on a running server (see scripts/*.bt)
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <stdint.h>
+
+/*
+    A probe is a nop in the code plus a note in the binary (.note.stapsdt) with its address and where its arguments are.
+    Tools attaching to it replace the nop with a breakpoint; unattached it costs the nop and the argument moves.
+    List them with: bpftrace -l 'usdt:build/release/server:*'
+
+    Probes (provider webserver):
+        accept(fd, client ip, client port)       new connection, in the main thread
+        read(fd, bytes)                          bytes read from the socket by http_conn::read()
+        enqueue(pool, task, queued)              task appended to a thread pool, with the queue length
+        dequeue(pool, task, queued)              task taken by a worker thread
+        parse(fd, HTTP_CODE)                     result of process_read()
+        resolve(fd, file_cache::STATUS, size)    file lookup of do_request()
+        write_done(fd, bytes, keep alive)        last byte of a response written
+
+    The probes come from <sys/sdt.h> (systemtap-sdt-dev) when it's installed. Without it, the same notes are written
+    here for x86-64, every argument as a signed 64-bit value; on other architectures the probes compile to nothing.
+*/
+
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+#define PROBE1(name, a1) DTRACE_PROBE1(webserver, name, a1)
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(webserver, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3(webserver, name, a1, a2, a3)
+
+#elif defined(__x86_64__)
+
+// The layout of a stapsdt note: probe address, base address (to correct for prelink), semaphore, provider, name, arguments
+#define PROBE_NOTE(name, args, ...) __asm__ __volatile__ ( \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"webserver\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n" \
+    :: __VA_ARGS__)
+
+#define PROBE1(name, a1) PROBE_NOTE(name, "-8@%[p1]", [p1] "nor" ((int64_t)(a1)))
+#define PROBE2(name, a1, a2) PROBE_NOTE(name, "-8@%[p1] -8@%[p2]", [p1] "nor" ((int64_t)(a1)), [p2] "nor" ((int64_t)(a2)))
+#define PROBE3(name, a1, a2, a3) PROBE_NOTE(name, "-8@%[p1] -8@%[p2] -8@%[p3]", \
+    [p1] "nor" ((int64_t)(a1)), [p2] "nor" ((int64_t)(a2)), [p3] "nor" ((int64_t)(a3)))
+
+#else
+
+#define PROBE1(name, a1) do { } while (0)
+#define PROBE2(name, a1, a2) do { } while (0)
+#define PROBE3(name, a1, a2, a3) do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,449 @@
+#include "proxy.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace {
+
+const int MAX_ROUTES = 32;
+// Idle keep-alive connections kept per upstream by each thread
+const int MAX_IDLE_PER_ROUTE = 32;
+const int UPSTREAM_TIMEOUT_SEC = 10;
+const int CLIENT_TIMEOUT_MS = 10000;
+const size_t RELAY_BUFFER_SIZE = 16384;
+
+struct route {
+    std::string prefix;
+    std::string name;
+    sockaddr_in address;
+
+    std::atomic<unsigned long> requests{0};
+    std::atomic<unsigned long> errors{0};
+    std::atomic<unsigned long> connects{0};
+    std::atomic<unsigned long> reuses{0};
+    // Time to the complete response header, and to the end of the response
+    std::atomic<unsigned long> header_us{0};
+    std::atomic<unsigned long> header_us_max{0};
+    std::atomic<unsigned long> total_us{0};
+};
+
+// Routes are added at startup, before any worker thread runs
+route routes[MAX_ROUTES];
+int route_count = 0;
+
+// Keep-alive connections of one thread, closed when the thread exits
+struct upstream_pool {
+    std::vector<int> idle[MAX_ROUTES];
+    ~upstream_pool() {
+        for (std::vector<int>& fds : idle) {
+            for (int fd : fds) {
+                close(fd);
+            }
+        }
+    }
+};
+
+thread_local upstream_pool t_pool;
+thread_local char t_buffer[RELAY_BUFFER_SIZE];
+
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void update_max(std::atomic<unsigned long>& max, unsigned long value) {
+    unsigned long cur = max.load(std::memory_order_relaxed);
+    while (value > cur && !max.compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+    }
+}
+
+// Tracks the framing of a chunked body to find where the response ends
+struct chunk_parser {
+    enum STATE {SIZE = 0, EXTENSION, DATA, DATA_END, TRAILER, DONE};
+    STATE state = SIZE;
+    size_t remaining = 0;
+    size_t line_len = 0;
+
+    // Consume bytes of the body, return how many belong to it (less than n once the last chunk ended)
+    size_t feed(const char* p, size_t n) {
+        size_t i = 0;
+        while (i < n && state != DONE) {
+            char c = p[i];
+            switch (state) {
+                case SIZE:
+                case EXTENSION:
+                    if (c == '\n') {
+                        state = remaining ? DATA : TRAILER;
+                        line_len = 0;
+                    } else if (state == SIZE && isxdigit((unsigned char)c)) {
+                        remaining = remaining * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower(c) - 'a' + 10));
+                    } else if (c == ';') {
+                        state = EXTENSION;
+                    }
+                    ++i;
+                    break;
+                case DATA: {
+                    size_t len = (n - i < remaining) ? n - i : remaining;
+                    remaining -= len;
+                    i += len;
+                    if (remaining == 0) {
+                        state = DATA_END;
+                    }
+                    break;
+                }
+                case DATA_END:
+                    // CRLF after the chunk data
+                    if (c == '\n') {
+                        state = SIZE;
+                    }
+                    ++i;
+                    break;
+                case TRAILER:
+                    // Trailer fields end with an empty line
+                    if (c == '\n') {
+                        if (line_len == 0) {
+                            state = DONE;
+                        }
+                        line_len = 0;
+                    } else if (c != '\r') {
+                        ++line_len;
+                    }
+                    ++i;
+                    break;
+                default:
+                    break;
+            }
+        }
+        return i;
+    }
+};
+
+// Idle pooled connection if one is still open, otherwise a new one
+int get_connection(int r, bool* reused) {
+    std::vector<int>& idle = t_pool.idle[r];
+    while (!idle.empty()) {
+        int fd = idle.back();
+        idle.pop_back();
+        // The upstream may have closed an idle connection: EAGAIN means it's still open and has nothing to say
+        char c;
+        if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN) {
+            *reused = true;
+            routes[r].reuses ++;
+            return fd;
+        }
+        close(fd);
+    }
+
+    *reused = false;
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct timeval tv = {UPSTREAM_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (sockaddr*)&routes[r].address, sizeof(routes[r].address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    routes[r].connects ++;
+    return fd;
+}
+
+void put_connection(int r, int fd) {
+    if ((int)t_pool.idle[r].size() < MAX_IDLE_PER_ROUTE) {
+        t_pool.idle[r].push_back(fd);
+    } else {
+        close(fd);
+    }
+}
+
+// Blocking send to the upstream (bounded by SO_SNDTIMEO)
+bool send_upstream(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Send to the non-blocking client socket, waiting while its send buffer is full
+bool send_client(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                return false;
+            }
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            if (poll(&pfd, 1, CLIENT_TIMEOUT_MS) <= 0) {
+                return false;
+            }
+            continue;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Value of the header field in the header lines [begin, end), NULL if absent
+const char* find_header(const char* begin, const char* end, const char* name, const char** value_end) {
+    size_t name_len = strlen(name);
+    const char* line = begin;
+    while (line < end) {
+        const char* eol = (const char*)memchr(line, '\n', end - line);
+        if (!eol) {
+            eol = end;
+        }
+        if ((size_t)(eol - line) > name_len && strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char* v = line + name_len + 1;
+            while (v < eol && (*v == ' ' || *v == '\t')) {
+                ++v;
+            }
+            const char* ve = eol;
+            while (ve > v && (ve[-1] == '\r' || ve[-1] == ' ')) {
+                --ve;
+            }
+            *value_end = ve;
+            return v;
+        }
+        line = eol + 1;
+    }
+    return NULL;
+}
+
+bool header_is(const char* begin, const char* end, const char* name, const char* value) {
+    const char* ve;
+    const char* v = find_header(begin, end, name, &ve);
+    return v && (size_t)(ve - v) == strlen(value) && strncasecmp(v, value, ve - v) == 0;
+}
+
+}
+
+bool proxy::add_route(const char* spec) {
+    const char* eq = strchr(spec, '=');
+    const char* colon = eq ? strrchr(eq, ':') : NULL;
+    if (!eq || !colon || spec[0] != '/' || route_count >= MAX_ROUTES) {
+        return false;
+    }
+
+    route& r = routes[route_count];
+    r.prefix.assign(spec, eq - spec);
+    r.name = eq + 1;
+    std::string ip(eq + 1, colon - eq - 1);
+    r.address.sin_family = AF_INET;
+    r.address.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, ip.c_str(), &r.address.sin_addr) != 1) {
+        return false;
+    }
+    route_count ++;
+    return true;
+}
+
+int proxy::match(const char* url) {
+    int best = -1;
+    size_t best_len = 0;
+    for (int i = 0; i < route_count; ++i) {
+        const std::string& prefix = routes[i].prefix;
+        if (prefix.size() < best_len || strncmp(url, prefix.c_str(), prefix.size()) != 0) {
+            continue;
+        }
+        // Whole path segments only: /api takes /api, /api/x and /api?q but not /apiary
+        char next = url[prefix.size()];
+        if (prefix.back() == '/' || next == '\0' || next == '/' || next == '?') {
+            best = i;
+            best_len = prefix.size();
+        }
+    }
+    return best;
+}
+
+proxy::RESULT proxy::forward(int r, int client_fd, const sockaddr_in& client, const char* url, const char* host, bool* keep_alive) {
+    route& rt = routes[r];
+    rt.requests ++;
+    uint64_t start = now_us();
+
+    // 1. Build the upstream request, the upstream connection is always kept alive
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client.sin_addr, ip, sizeof(ip));
+    std::string request = std::string("GET ") + url + " HTTP/1.1\r\nHost: " + (host ? host : rt.name.c_str())
+        + "\r\nX-Forwarded-For: " + ip + "\r\nConnection: keep-alive\r\n\r\n";
+
+    // 2. Send it and wait for the complete response header.
+    // A pooled connection may have been closed by the upstream meanwhile: retry once on a new connection.
+    char* buf = t_buffer;
+    size_t len = 0;
+    char* header_end = NULL;
+    int fd = -1;
+    for (int attempt = 0; attempt < 2 && !header_end; ++attempt) {
+        bool reused = false;
+        fd = get_connection(r, &reused);
+        if (fd < 0) {
+            rt.errors ++;
+            return PROXY_BAD_GATEWAY;
+        }
+
+        len = 0;
+        bool timeout = false;
+        if (send_upstream(fd, request.data(), request.size())) {
+            while (len < RELAY_BUFFER_SIZE) {
+                ssize_t n = recv(fd, buf + len, RELAY_BUFFER_SIZE - len, 0);
+                if (n <= 0) {
+                    timeout = (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+                    break;
+                }
+                len += n;
+                header_end = (char*)memmem(buf, len, "\r\n\r\n", 4);
+                if (header_end) {
+                    break;
+                }
+            }
+        }
+
+        if (!header_end) {
+            close(fd);
+            if (timeout || len > 0 || !reused) {
+                rt.errors ++;
+                return timeout ? PROXY_TIMEOUT : PROXY_BAD_GATEWAY;
+            }
+        }
+    }
+    if (!header_end) {
+        rt.errors ++;
+        return PROXY_BAD_GATEWAY;
+    }
+    header_end += 4;
+
+    uint64_t header_time = now_us() - start;
+    rt.header_us += header_time;
+    update_max(rt.header_us_max, header_time);
+
+    // 3. Work out where the body ends
+    int status = 0;
+    if (sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1) {
+        close(fd);
+        rt.errors ++;
+        return PROXY_BAD_GATEWAY;
+    }
+    const char* fields = (const char*)memchr(buf, '\n', header_end - buf) + 1;
+    bool http10 = strncmp(buf, "HTTP/1.0", 8) == 0;
+    bool upstream_alive = http10 ? header_is(fields, header_end, "Connection", "keep-alive")
+                                 : !header_is(fields, header_end, "Connection", "close");
+    bool chunked = header_is(fields, header_end, "Transfer-Encoding", "chunked");
+    const char* ve;
+    const char* cl = find_header(fields, header_end, "Content-Length", &ve);
+    long body_left = cl ? atol(cl) : -1;
+    if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+        body_left = 0;
+        chunked = false;
+    }
+    // Neither length nor chunks: the body ends when the upstream closes, and so must the client connection
+    if (!chunked && body_left < 0) {
+        upstream_alive = false;
+        *keep_alive = false;
+    }
+
+    // 4. Send the header, replacing the hop-by-hop fields
+    std::string out(buf, fields - buf);
+    const char* line = fields;
+    while (line < header_end - 2) {
+        const char* eol = (const char*)memchr(line, '\n', header_end - line) + 1;
+        if (strncasecmp(line, "Connection:", 11) != 0 && strncasecmp(line, "Keep-Alive:", 11) != 0) {
+            out.append(line, eol - line);
+        }
+        line = eol;
+    }
+    char timing[64];
+    snprintf(timing, sizeof(timing), "Server-Timing: upstream;dur=%.3f\r\n", header_time / 1000.0);
+    out += timing;
+    out += *keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    if (!send_client(client_fd, out.data(), out.size())) {
+        close(fd);
+        rt.errors ++;
+        return PROXY_FAILED;
+    }
+
+    // 5. Stream the body through the buffer
+    chunk_parser chunks;
+    char* data = header_end;
+    size_t data_len = buf + len - header_end;
+    bool done = (!chunked && body_left == 0);
+    bool failed = false;
+    while (!done) {
+        if (data_len > 0) {
+            size_t body = data_len;
+            if (chunked) {
+                body = chunks.feed(data, data_len);
+                done = (chunks.state == chunk_parser::DONE);
+            } else if (body_left >= 0) {
+                body = ((long)data_len < body_left) ? data_len : body_left;
+                body_left -= body;
+                done = (body_left == 0);
+            }
+            // Anything after the end of the response is garbage, don't reuse the connection
+            if (body < data_len) {
+                upstream_alive = false;
+            }
+            if (!send_client(client_fd, data, body)) {
+                failed = true;
+                break;
+            }
+            if (done) {
+                break;
+            }
+        }
+
+        ssize_t n = recv(fd, buf, RELAY_BUFFER_SIZE, 0);
+        if (n <= 0) {
+            // Only a close-delimited body may end here
+            done = (n == 0 && !chunked && body_left < 0);
+            failed = !done;
+            break;
+        }
+        data = buf;
+        data_len = n;
+    }
+
+    if (failed || !upstream_alive) {
+        close(fd);
+    } else {
+        put_connection(r, fd);
+    }
+    rt.total_us += now_us() - start;
+    if (failed) {
+        rt.errors ++;
+        return PROXY_FAILED;
+    }
+    return PROXY_DONE;
+}
+
+void proxy::dump_stats(FILE* fp) {
+    for (int i = 0; i < route_count; ++i) {
+        route& r = routes[i];
+        unsigned long requests = r.requests.load();
+        unsigned long served = requests - r.errors.load();
+        fprintf(fp, "proxy %s -> %s: %lu requests, %lu errors, %lu connects, %lu reuses, upstream header avg %.3f ms (max %.3f ms), total avg %.3f ms\n",
+            r.prefix.c_str(), r.name.c_str(), requests, r.errors.load(), r.connects.load(), r.reuses.load(),
+            served ? r.header_us.load() / 1000.0 / served : 0.0, r.header_us_max.load() / 1000.0,
+            served ? r.total_us.load() / 1000.0 / served : 0.0);
+    }
+}
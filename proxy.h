@@ -0,0 +1,35 @@
+// Reverse proxy to local upstream servers
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+    URL prefixes are forwarded to configured upstreams instead of being mapped to files under doc_root.
+    Every worker thread keeps its own pool of keep-alive connections per upstream, so no lock is taken on the request path,
+    and streams the response to the client through a fixed-size buffer.
+*/
+class proxy {
+public:
+    // Result of forwarding a request
+    enum RESULT {
+        PROXY_DONE = 0,     // The response has been sent to the client
+        PROXY_BAD_GATEWAY,  // Nothing has been sent, the upstream is unreachable or answered garbage
+        PROXY_TIMEOUT,      // Nothing has been sent, the upstream didn't answer in time
+        PROXY_FAILED        // The response was cut in the middle, the client connection must be closed
+    };
+
+    // Add a route "prefix=host:port", e.g. "/api=127.0.0.1:8080"
+    static bool add_route(const char* spec);
+    // Index of the route of the longest prefix matching url at a path boundary, -1 if the url is served from doc_root
+    static int match(const char* url);
+    // Forward a GET request to the upstream of the route and stream the response to client_fd.
+    // keep_alive: whether the client connection is kept afterwards; set to false if the response can't be delimited.
+    static RESULT forward(int route, int client_fd, const sockaddr_in& client, const char* url, const char* host, bool* keep_alive);
+    // Print the per-upstream counters and latencies
+    static void dump_stats(FILE* fp);
+};
+
+#endif
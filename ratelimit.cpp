@@ -0,0 +1,214 @@
+#include "ratelimit.h"
+#include "locker.h"
+#include <time.h>
+
+bool rate_limiter::m_enabled = false;
+
+namespace {
+
+const int SHARDS = 64;
+const int SLOTS_PER_SHARD = 4096;
+// Slots probed from the home slot of an address
+const int MAX_PROBE = 32;
+// Idle time after which a client without connections may lose its slot
+const uint64_t IDLE_EXPIRY_MS = 60000;
+// Marks a slot being reassigned, any concurrent conns++ sees a negative count
+const int CLAIMED = -(1 << 30);
+const uint64_t TOKEN = 1000;
+const uint64_t TOKENS_MASK = (1 << 24) - 1;
+
+struct shard {
+    locker lock;
+    client_state slots[SLOTS_PER_SHARD];
+};
+
+shard* table = nullptr;
+int conn_limit = 0;
+// Micro-tokens added per millisecond (requests per second * 1000, so that fractional rates aren't truncated),
+// the bucket size in milli-tokens, and the time an empty bucket takes to fill
+uint64_t refill_rate = 0;
+uint64_t bucket_size = 0;
+uint64_t fill_ms = 0;
+
+std::atomic<unsigned long> rejected_connections(0);
+std::atomic<unsigned long> limited_requests(0);
+std::atomic<unsigned long> untracked_clients(0);
+std::atomic<unsigned long> tracked_clients(0);
+
+uint64_t now_ms() {
+    static struct timespec start = [] {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts;
+    }();
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - start.tv_sec) * 1000 + (ts.tv_nsec - start.tv_nsec) / 1000000 + 1;
+}
+
+uint32_t hash(uint32_t addr) {
+    return addr * 2654435761u;
+}
+
+client_state* lookup(shard& sh, uint32_t home, uint32_t addr) {
+    for (int i = 0; i < MAX_PROBE; ++i) {
+        client_state& s = sh.slots[(home + i) % SLOTS_PER_SHARD];
+        uint32_t key = s.addr.load(std::memory_order_acquire);
+        if (key == addr) {
+            return &s;
+        }
+        if (key == 0) {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+// Find the slot of the address or give it one, NULL if its probe window is full
+client_state* find_or_insert(uint32_t addr, uint64_t now) {
+    uint32_t h = hash(addr);
+    shard& sh = table[h % SHARDS];
+    uint32_t home = (h / SHARDS) % SLOTS_PER_SHARD;
+
+    client_state* state = lookup(sh, home, addr);
+    if (state) {
+        return state;
+    }
+
+    sh.lock.lock();
+    state = lookup(sh, home, addr);
+    for (int i = 0; !state && i < MAX_PROBE; ++i) {
+        client_state& s = sh.slots[(home + i) % SLOTS_PER_SHARD];
+        uint32_t key = s.addr.load(std::memory_order_relaxed);
+        int zero = 0;
+        if (key != 0) {
+            // Lazy expiry: take over the slot of a client that has been gone for a while
+            if (now - s.last_seen.load(std::memory_order_relaxed) < IDLE_EXPIRY_MS || !s.conns.compare_exchange_strong(zero, CLAIMED)) {
+                continue;
+            }
+        } else {
+            s.conns.fetch_add(CLAIMED);
+            tracked_clients ++;
+        }
+        s.bucket.store(now << 24 | bucket_size, std::memory_order_relaxed);
+        s.last_seen.store(now, std::memory_order_relaxed);
+        s.addr.store(addr, std::memory_order_release);
+        // Adding back keeps the increments of readers that raced with the claim
+        s.conns.fetch_sub(CLAIMED);
+        state = &s;
+    }
+    sh.lock.unlock();
+    return state;
+}
+
+}
+
+void rate_limiter::configure(int limit, double rate, double burst) {
+    conn_limit = limit > 0 ? limit : 0;
+    refill_rate = rate > 0 ? (uint64_t)(rate * 1000 + 0.5) : 0;
+    // A rate too small to represent is still a limit, not none
+    if (rate > 0 && refill_rate == 0) {
+        refill_rate = 1;
+    }
+    // The bucket holds at least one request, or a rate under 1/s would never allow any
+    if (burst < rate) {
+        burst = rate;
+    }
+    if (burst < 1) {
+        burst = 1;
+    }
+    bucket_size = (uint64_t)(burst * TOKEN);
+    if (bucket_size > TOKENS_MASK) {
+        bucket_size = TOKENS_MASK;
+    }
+    fill_ms = refill_rate > 0 ? bucket_size * 1000 / refill_rate + 1 : 0;
+    m_enabled = conn_limit > 0 || refill_rate > 0;
+    if (m_enabled && !table) {
+        table = new shard[SHARDS];
+    }
+}
+
+bool rate_limiter::open_connection(in_addr_t addr, client_state** result) {
+    *result = nullptr;
+    if (!m_enabled) {
+        return true;
+    }
+
+    uint64_t now = now_ms();
+    while (true) {
+        client_state* state = find_or_insert(addr, now);
+        if (!state) {
+            untracked_clients ++;
+            return true;
+        }
+
+        int conns = state->conns.fetch_add(1) + 1;
+        // The slot was reassigned between the lookup and the increment, look again
+        if (conns <= 0 || state->addr.load(std::memory_order_acquire) != addr) {
+            state->conns.fetch_sub(1);
+            continue;
+        }
+        state->last_seen.store(now, std::memory_order_relaxed);
+
+        if (conn_limit > 0 && conns > conn_limit) {
+            state->conns.fetch_sub(1);
+            rejected_connections ++;
+            return false;
+        }
+        *result = state;
+        return true;
+    }
+}
+
+void rate_limiter::close_connection(client_state* state) {
+    if (state) {
+        state->last_seen.store(now_ms(), std::memory_order_relaxed);
+        state->conns.fetch_sub(1);
+    }
+}
+
+bool rate_limiter::allow_request(client_state* state) {
+    if (!state || refill_rate == 0) {
+        return true;
+    }
+
+    uint64_t now = now_ms();
+    state->last_seen.store(now, std::memory_order_relaxed);
+    uint64_t old = state->bucket.load(std::memory_order_relaxed);
+    while (true) {
+        uint64_t last = old >> 24;
+        uint64_t tokens = old & TOKENS_MASK;
+        // Refill for the time elapsed since the last refill. The clock only advances by the time of the whole
+        // milli-tokens added, the fraction left counts towards the next refill.
+        if (now > last) {
+            if (now - last >= fill_ms) {
+                tokens = bucket_size;
+                last = now;
+            } else {
+                uint64_t added = (now - last) * refill_rate / 1000;
+                tokens += added;
+                last += added * 1000 / refill_rate;
+                if (tokens >= bucket_size) {
+                    tokens = bucket_size;
+                    last = now;
+                }
+            }
+        }
+        if (tokens < TOKEN) {
+            limited_requests ++;
+            return false;
+        }
+        uint64_t updated = last << 24 | (tokens - TOKEN);
+        if (state->bucket.compare_exchange_weak(old, updated, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+void rate_limiter::dump_stats(FILE* fp) {
+    if (!m_enabled) {
+        return;
+    }
+    fprintf(fp, "rate limiter: %lu clients tracked, %lu untracked (table full), %lu connections rejected, %lu requests limited\n",
+        tracked_clients.load(), untracked_clients.load(), rejected_connections.load(), limited_requests.load());
+}
@@ -0,0 +1,45 @@
+// Per-client connection caps and request rate limits
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+// State of one client IP, lives in a slot of the client table
+struct client_state {
+    // IPv4 address in network order, 0 for a free slot
+    std::atomic<uint32_t> addr;
+    // Open connections; negative while the slot is being handed to another address
+    std::atomic<int> conns;
+    // Token bucket: milliseconds since start of the last refill << 24 | milli-tokens
+    std::atomic<uint64_t> bucket;
+    // Milliseconds since start of the last connection or request
+    std::atomic<uint64_t> last_seen;
+};
+
+/*
+    Clients are kept in a sharded open-addressing table:
+        - Lookups don't lock: slots are never emptied, so probe sequences stay intact;
+        - Inserts lock their shard only;
+        - There's no expiry pass: a slot whose client has no connection and was idle for a while is reused by the next insert probing over it.
+    When the table is full, new clients are not limited.
+*/
+class rate_limiter {
+public:
+    // conn_limit: connections per client, 0 for no cap; rate: requests per second per client, 0 for no limit; burst: size of the bucket
+    static void configure(int conn_limit, double rate, double burst);
+    // Count a new connection of the client. Returns false if the client already has conn_limit connections.
+    // *state is passed to allow_request() and close_connection(), it's NULL if the client isn't tracked.
+    static bool open_connection(in_addr_t addr, client_state** state);
+    static void close_connection(client_state* state);
+    // Take a token from the bucket of the client, false if it's empty
+    static bool allow_request(client_state* state);
+    static void dump_stats(FILE* fp);
+
+private:
+    static bool m_enabled;
+};
+
+#endif
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Profile-guided optimization of the server:
+#   1. build an instrumented server (pgo-generate preset);
+#   2. run the benchmark request mix against it, in both connection modes, to record the profile;
+#   3. rebuild with the profile (pgo-use preset);
+#   4. run the same workload against the release-lto and pgo-use builds to measure the gain.
+#
+# Environment: PORT (default 10080), DURATION seconds per run (default 20), DOC_ROOT (default resources/),
+#              MIX request mix file passed to bench -m, BENCH_ARGS extra bench arguments.
+set -e
+cd "$(dirname "$0")/.."
+
+PORT=${PORT:-10080}
+DURATION=${DURATION:-20}
+DOC_ROOT=${DOC_ROOT:-$PWD/resources}
+BENCH_ARGS="${BENCH_ARGS:-} ${MIX:+-m $MIX}"
+
+# run_workload <server binary> <seconds> [server options...]
+run_workload() {
+    local server=$1 seconds=$2
+    shift 2
+    "$server" -r "$DOC_ROOT" "$@" "$PORT" > /dev/null &
+    local pid=$!
+    sleep 1
+    build/release/bench -d "$seconds" $BENCH_ARGS 127.0.0.1 "$PORT"
+    # SIGTERM shuts the server down cleanly, which is when the profile is written
+    kill -TERM "$pid"
+    wait "$pid"
+}
+
+cmake --preset release > /dev/null && cmake --build --preset release --target bench
+
+echo "== Instrumented build"
+rm -rf pgo-data
+cmake --preset pgo-generate > /dev/null && cmake --build --preset pgo-generate --target server
+run_workload build/pgo-generate/server $((DURATION / 2))
+run_workload build/pgo-generate/server $((DURATION / 2)) -c
+
+if ls pgo-data/*.profraw > /dev/null 2>&1; then
+    llvm-profdata merge -output=pgo-data/server.profdata pgo-data/*.profraw
+fi
+
+echo "== Optimized builds"
+cmake --preset release-lto > /dev/null && cmake --build --preset release-lto --target server
+cmake --preset pgo-use > /dev/null && cmake --build --preset pgo-use --target server
+
+echo "== release-lto"
+run_workload build/release-lto/server "$DURATION"
+echo "== pgo-use"
+run_workload build/pgo-use/server "$DURATION"
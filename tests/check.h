@@ -0,0 +1,23 @@
+// Minimal checks shared by the tests: no framework, a test program exits with the number of failed checks
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+static int check_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        check_failures ++; \
+    } \
+} while (0)
+
+// Run a test function and report it
+#define RUN(test) do { \
+    int before = check_failures; \
+    test(); \
+    printf("%s %s\n", check_failures == before ? "ok  " : "FAIL", #test); \
+} while (0)
+
+#endif
@@ -0,0 +1,290 @@
+// HTTP/2 sessions driven in memory: framing, flow control and the limits on a client that doesn't read
+#include "h2.h"
+#include "check.h"
+#include <string.h>
+#include <vector>
+
+namespace {
+
+enum {DATA = 0, HEADERS = 1, SETTINGS = 4, PING = 6, GOAWAY = 7, WINDOW_UPDATE = 8};
+const uint8_t FLAG_END_STREAM = 0x1;
+const uint8_t FLAG_ACK = 0x1;
+const uint8_t FLAG_END_HEADERS = 0x4;
+const uint16_t INITIAL_WINDOW_SIZE = 4;
+const uint32_t PROTOCOL_ERROR = 1;
+const uint32_t ENHANCE_YOUR_CALM = 11;
+
+const std::string big(200000, 'x');
+
+// /small is 5 bytes, /big 200000, anything else is a 404 without a body
+void resolve(void*, const h2_request& request, h2_response* response) {
+    response->status = 200;
+    if (request.path == "/small") {
+        response->data = "hello";
+        response->size = 5;
+    } else if (request.path == "/big") {
+        response->data = big.data();
+        response->size = big.size();
+    } else {
+        response->status = 404;
+    }
+}
+
+struct frame {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t id;
+    std::string payload;
+};
+
+uint32_t get32(const std::string& s, size_t at) {
+    const uint8_t* p = (const uint8_t*)s.data() + at;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+std::string frame_bytes(uint8_t type, uint8_t flags, uint32_t id, const std::string& payload) {
+    std::string out;
+    out.push_back((char)(payload.size() >> 16));
+    out.push_back((char)(payload.size() >> 8));
+    out.push_back((char)payload.size());
+    out.push_back((char)type);
+    out.push_back((char)flags);
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back((char)(id >> shift));
+    }
+    return out + payload;
+}
+
+std::string be32(uint32_t v) {
+    std::string out;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back((char)(v >> shift));
+    }
+    return out;
+}
+
+std::string setting(uint16_t id, uint32_t value) {
+    std::string out;
+    out.push_back((char)(id >> 8));
+    out.push_back((char)id);
+    return out + be32(value);
+}
+
+// The client side of a session: it writes frames into it and reads back what the server sends
+struct client {
+    h2_session session;
+    hpack_encoder encoder;
+    hpack_decoder decoder;
+    std::vector<frame> frames;
+
+    client() : session(resolve, NULL) {
+        session.start();
+    }
+
+    bool send(const std::string& bytes) {
+        return session.feed(bytes.data(), bytes.size());
+    }
+
+    // Preface and SETTINGS, then read the server's SETTINGS and ACK
+    bool connect(const std::string& settings = "") {
+        bool ok = send(std::string(H2_PREFACE, H2_PREFACE_LEN) + frame_bytes(SETTINGS, 0, 0, settings));
+        read();
+        return ok;
+    }
+
+    bool get(uint32_t id, const char* path) {
+        std::string block;
+        encoder.begin(&block);
+        encoder.encode(":method", "GET", false, &block);
+        encoder.encode(":scheme", "http", false, &block);
+        encoder.encode(":path", path, false, &block);
+        encoder.encode(":authority", "localhost", false, &block);
+        return send(frame_bytes(HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, id, block));
+    }
+
+    bool window_update(uint32_t id, uint32_t increment) {
+        return send(frame_bytes(WINDOW_UPDATE, 0, id, be32(increment)));
+    }
+
+    // Take everything the server has to send, into frames
+    void read() {
+        session.fill();
+        std::string out(session.output(), session.output_size());
+        session.consume(out.size());
+        frames.clear();
+        for (size_t pos = 0; pos + 9 <= out.size(); ) {
+            const uint8_t* p = (const uint8_t*)out.data() + pos;
+            uint32_t len = (p[0] << 16) | (p[1] << 8) | p[2];
+            frame f = {p[3], p[4], get32(out, pos + 5) & 0x7fffffff, out.substr(pos + 9, len)};
+            frames.push_back(f);
+            pos += 9 + len;
+        }
+    }
+
+    // Bytes of DATA frames read last time, the largest frame in max_frame
+    size_t data_bytes(size_t* max_frame = NULL) const {
+        size_t total = 0;
+        for (const frame& f : frames) {
+            if (f.type == DATA) {
+                total += f.payload.size();
+                if (max_frame && f.payload.size() > *max_frame) {
+                    *max_frame = f.payload.size();
+                }
+            }
+        }
+        return total;
+    }
+
+    const frame* find(uint8_t type) const {
+        for (const frame& f : frames) {
+            if (f.type == type) {
+                return &f;
+            }
+        }
+        return NULL;
+    }
+};
+
+void test_request() {
+    client c;
+    CHECK(c.connect());
+    CHECK(c.frames.size() == 2);
+    CHECK(c.frames[0].type == SETTINGS && !(c.frames[0].flags & FLAG_ACK));
+    CHECK(c.frames[1].type == SETTINGS && (c.frames[1].flags & FLAG_ACK));
+
+    CHECK(c.get(1, "/small"));
+    c.read();
+    const frame* headers = c.find(HEADERS);
+    CHECK(headers && headers->id == 1);
+    std::vector<hpack_field> fields;
+    CHECK(headers && c.decoder.decode((const uint8_t*)headers->payload.data(), headers->payload.size(), &fields));
+    CHECK(!fields.empty() && fields[0] == hpack_field(":status", "200"));
+    const frame* data = c.find(DATA);
+    CHECK(data && data->id == 1 && data->payload == "hello" && (data->flags & FLAG_END_STREAM));
+
+    // No body: the HEADERS frame ends the stream
+    CHECK(c.get(3, "/missing"));
+    c.read();
+    CHECK(c.frames.size() == 1 && c.frames[0].type == HEADERS && (c.frames[0].flags & FLAG_END_STREAM));
+    CHECK(c.session.output_size() == 0);
+}
+
+void test_protocol_errors() {
+    client bad_preface;
+    CHECK(!bad_preface.send("GET / HTTP/1.1\r\n\r\n"));
+
+    // The first frame after the preface must be SETTINGS
+    client no_settings;
+    CHECK(!no_settings.send(std::string(H2_PREFACE, H2_PREFACE_LEN) + frame_bytes(PING, 0, 0, std::string(8, 'p'))));
+    no_settings.read();
+    const frame* goaway = no_settings.find(GOAWAY);
+    CHECK(goaway && get32(goaway->payload, 4) == PROTOCOL_ERROR);
+    CHECK(no_settings.session.finished());
+
+    // Client streams have odd ids
+    client even;
+    CHECK(even.connect());
+    CHECK(!even.get(2, "/small"));
+}
+
+void test_flow_control() {
+    client c;
+    CHECK(c.connect());
+    CHECK(c.get(1, "/big"));
+    c.read();
+    size_t max_frame = 0;
+    // The default windows are 65535 bytes, in frames of at most 16384
+    CHECK(c.data_bytes(&max_frame) == 65535);
+    CHECK(max_frame <= 16384);
+
+    // Both windows have to open for more to come
+    CHECK(c.window_update(0, 100000));
+    c.read();
+    CHECK(c.data_bytes() == 0);
+    CHECK(c.window_update(1, 1000));
+    c.read();
+    CHECK(c.data_bytes() == 1000);
+
+    // Overflowing the connection window is a connection error
+    CHECK(!c.window_update(0, 0x7fffffff));
+}
+
+// A smaller INITIAL_WINDOW_SIZE takes a stream that has sent data below zero: it must wait, not crash the server
+void test_negative_window() {
+    client c;
+    CHECK(c.connect(setting(INITIAL_WINDOW_SIZE, 1 << 20)));
+    CHECK(c.get(1, "/big"));
+    c.read();
+    // Limited by the connection window
+    CHECK(c.data_bytes() == 65535);
+
+    // Stream window: 1 MB - 65535 - 1 MB
+    CHECK(c.send(frame_bytes(SETTINGS, 0, 0, setting(INITIAL_WINDOW_SIZE, 0))));
+    CHECK(c.window_update(0, 1 << 20));
+    c.read();
+    CHECK(c.data_bytes() == 0);
+    CHECK(c.find(SETTINGS) != NULL);
+
+    CHECK(c.window_update(1, 65535));
+    c.read();
+    CHECK(c.data_bytes() == 0);
+    CHECK(c.window_update(1, 10));
+    c.read();
+    CHECK(c.data_bytes() == 10);
+}
+
+// PINGs that the client never reads the answers to end the connection
+void test_ping_flood() {
+    client c;
+    CHECK(c.connect());
+    std::string ping = frame_bytes(PING, 0, 0, std::string(8, 'p'));
+    std::string flood;
+    for (int i = 0; i < 2000; ++i) {
+        flood += ping;
+    }
+    CHECK(!c.send(flood));
+    c.read();
+    const frame* goaway = c.find(GOAWAY);
+    CHECK(goaway && get32(goaway->payload, 4) == ENHANCE_YOUR_CALM);
+
+    // Answers that are read don't add up
+    client reader;
+    CHECK(reader.connect());
+    for (int i = 0; i < 2000; ++i) {
+        CHECK(reader.send(ping));
+        reader.read();
+    }
+    CHECK(reader.frames.size() == 1 && reader.frames[0].type == PING && (reader.frames[0].flags & FLAG_ACK));
+}
+
+// Frames wait while the output is over its high-water mark, and are handled once it drains
+void test_pause() {
+    client c;
+    CHECK(c.connect(setting(INITIAL_WINDOW_SIZE, 1 << 20)));
+    CHECK(c.window_update(0, 1 << 20));
+    CHECK(c.get(1, "/big"));
+    c.session.fill();
+    CHECK(c.session.output_size() >= 64 * 1024);
+
+    CHECK(c.send(frame_bytes(PING, 0, 0, std::string(8, 'p'))));
+    CHECK(c.session.paused());
+
+    c.read();
+    CHECK(c.find(PING) == NULL);
+    CHECK(c.session.feed(NULL, 0));
+    CHECK(!c.session.paused());
+    c.read();
+    CHECK(c.find(PING) != NULL);
+}
+
+}
+
+int main() {
+    RUN(test_request);
+    RUN(test_protocol_errors);
+    RUN(test_flow_control);
+    RUN(test_negative_window);
+    RUN(test_ping_flood);
+    RUN(test_pause);
+    return check_failures;
+}
@@ -0,0 +1,123 @@
+// HPACK: the examples of RFC 7541 appendix C, round trips through the encoder, and malformed blocks
+#include "hpack.h"
+#include "check.h"
+#include <string.h>
+
+namespace {
+
+std::string unhex(const char* hex) {
+    std::string out;
+    for (size_t i = 0; hex[i] && hex[i + 1]; i += 2) {
+        unsigned int byte;
+        sscanf(hex + i, "%2x", &byte);
+        out.push_back((char)byte);
+    }
+    return out;
+}
+
+bool decode(hpack_decoder& decoder, const std::string& block, std::vector<hpack_field>* fields) {
+    fields->clear();
+    return decoder.decode((const uint8_t*)block.data(), block.size(), fields);
+}
+
+bool has(const std::vector<hpack_field>& fields, const char* name, const char* value) {
+    for (const hpack_field& f : fields) {
+        if (f.first == name && f.second == value) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// C.3: requests without Huffman coding, the second one refers to the dynamic table
+void test_rfc_requests() {
+    hpack_decoder decoder;
+    std::vector<hpack_field> fields;
+    CHECK(decode(decoder, unhex("828684410f7777772e6578616d706c652e636f6d"), &fields));
+    CHECK(fields.size() == 4);
+    CHECK(has(fields, ":method", "GET"));
+    CHECK(has(fields, ":scheme", "http"));
+    CHECK(has(fields, ":path", "/"));
+    CHECK(has(fields, ":authority", "www.example.com"));
+
+    CHECK(decode(decoder, unhex("828684be58086e6f2d6361636865"), &fields));
+    CHECK(fields.size() == 5);
+    CHECK(has(fields, ":authority", "www.example.com"));
+    CHECK(has(fields, "cache-control", "no-cache"));
+}
+
+// C.4: the same requests with Huffman coded strings
+void test_rfc_huffman() {
+    hpack_decoder decoder;
+    std::vector<hpack_field> fields;
+    CHECK(decode(decoder, unhex("828684418cf1e3c2e5f23a6ba0ab90f4ff"), &fields));
+    CHECK(has(fields, ":authority", "www.example.com"));
+    CHECK(decode(decoder, unhex("828684be5886a8eb10649cbf"), &fields));
+    CHECK(has(fields, "cache-control", "no-cache"));
+
+    std::string coded;
+    huffman_encode("www.example.com", &coded);
+    CHECK(coded == unhex("f1e3c2e5f23a6ba0ab90f4ff"));
+    CHECK(huffman_length("www.example.com") == coded.size());
+    std::string plain;
+    CHECK(huffman_decode((const uint8_t*)coded.data(), coded.size(), &plain));
+    CHECK(plain == "www.example.com");
+}
+
+// What the server encodes, its peer decodes, across blocks sharing the dynamic table
+void test_round_trip() {
+    hpack_encoder encoder;
+    hpack_decoder decoder;
+    std::vector<hpack_field> fields;
+    for (int i = 0; i < 3; ++i) {
+        std::string block;
+        encoder.begin(&block);
+        encoder.encode(":status", "200", false, &block);
+        encoder.encode("content-type", "text/html", true, &block);
+        encoder.encode("content-length", std::to_string(1000 * i), false, &block);
+        encoder.encode("etag", "\"abc\"", true, &block);
+        CHECK(decode(decoder, block, &fields));
+        CHECK(fields.size() == 4);
+        CHECK(has(fields, ":status", "200"));
+        CHECK(has(fields, "content-type", "text/html"));
+        CHECK(has(fields, "content-length", std::to_string(1000 * i).c_str()));
+        CHECK(has(fields, "etag", "\"abc\""));
+        // Indexed fields cost a byte once they're in the table
+        if (i > 0) {
+            CHECK(block.size() < 16);
+        }
+    }
+}
+
+void test_malformed() {
+    std::vector<hpack_field> fields;
+    // Index 0, and an index past both tables
+    hpack_decoder d1;
+    CHECK(!decode(d1, unhex("80"), &fields));
+    hpack_decoder d2;
+    CHECK(!decode(d2, unhex("ff00"), &fields));
+    // Integer and string cut short
+    hpack_decoder d3;
+    CHECK(!decode(d3, unhex("ff"), &fields));
+    hpack_decoder d4;
+    CHECK(!decode(d4, unhex("410f7777"), &fields));
+    // Table size update over the advertised limit
+    hpack_decoder d5(4096);
+    CHECK(!decode(d5, unhex("3fe21f"), &fields));
+    // Huffman padding longer than 7 bits, and padding that isn't all ones
+    std::string plain;
+    const uint8_t long_padding[] = {0xff, 0xff};
+    CHECK(!huffman_decode(long_padding, sizeof(long_padding), &plain));
+    const uint8_t zero_padding[] = {0x00};
+    CHECK(!huffman_decode(zero_padding, sizeof(zero_padding), &plain));
+}
+
+}
+
+int main() {
+    RUN(test_rfc_requests);
+    RUN(test_rfc_huffman);
+    RUN(test_round_trip);
+    RUN(test_malformed);
+    return check_failures;
+}
@@ -0,0 +1,172 @@
+// HTTP/1.1 requests through a connection on one end of a socket pair: parsing, responses, pipelining
+#include "http_conn.h"
+#include "vhost.h"
+#include "file_cache.h"
+#include "check.h"
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <string>
+
+namespace {
+
+const char INDEX[] = "<html>index</html>\n";
+
+// A connection as the LT mode drives it: the main thread reads, a worker parses and responds, the main thread writes
+struct client {
+    int fd;
+    http_conn* conn;
+
+    client() {
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        fd = fds[0];
+        conn = new http_conn();
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        conn->init(fds[1], addr);
+    }
+
+    ~client() {
+        conn->close_conn();
+        delete conn;
+        close(fd);
+    }
+
+    // Send bytes and let the connection handle them; returns whether it keeps the connection
+    bool send(const std::string& data) {
+        ::send(fd, data.data(), data.size(), 0);
+        if (!conn->read()) {
+            return false;
+        }
+        conn->process();
+        // Written only once the connection asks for EPOLLOUT, as the main loop does
+        epoll_event event;
+        if (epoll_wait(http_conn::m_epollfd, &event, 1, 0) == 1 && (event.events & EPOLLOUT)) {
+            return conn->write();
+        }
+        return true;
+    }
+
+    // Everything the connection has written so far
+    std::string receive() {
+        std::string out;
+        char buf[4096];
+        ssize_t n;
+        while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            out.append(buf, n);
+        }
+        return out;
+    }
+};
+
+int count(const std::string& s, const char* what) {
+    int n = 0;
+    for (size_t at = s.find(what); at != std::string::npos; at = s.find(what, at + 1)) {
+        n ++;
+    }
+    return n;
+}
+
+std::string get(const char* target, const char* headers = "Connection: keep-alive\r\n") {
+    return std::string("GET ") + target + " HTTP/1.1\r\nHost: localhost\r\n" + headers + "\r\n";
+}
+
+void test_get() {
+    client c;
+    CHECK(c.send(get("/index.html")));
+    std::string response = c.receive();
+    CHECK(response.compare(0, 15, "HTTP/1.1 200 OK") == 0);
+    CHECK(response.find("Content-Length: " + std::to_string(strlen(INDEX))) != std::string::npos);
+    CHECK(response.size() > strlen(INDEX) && response.compare(response.size() - strlen(INDEX), strlen(INDEX), INDEX) == 0);
+}
+
+void test_absolute_form() {
+    client c;
+    CHECK(c.send(get("http://localhost:10000/index.html")));
+    CHECK(c.receive().compare(0, 15, "HTTP/1.1 200 OK") == 0);
+}
+
+// A request arriving in pieces is answered once its blank line is there
+void test_split_request() {
+    client c;
+    std::string request = get("/index.html");
+    CHECK(c.send(request.substr(0, 20)));
+    CHECK(c.receive().empty());
+    CHECK(c.send(request.substr(20)));
+    CHECK(c.receive().compare(0, 15, "HTTP/1.1 200 OK") == 0);
+}
+
+void test_errors() {
+    {
+        client c;
+        c.send(get("/missing.html"));
+        CHECK(c.receive().compare(0, 12, "HTTP/1.1 404") == 0);
+    }
+    {
+        client c;
+        // Only GET is served, and only HTTP/1.1
+        CHECK(!c.send("POST /index.html HTTP/1.1\r\nContent-Length: 0\r\n\r\n"));
+        CHECK(c.receive().compare(0, 12, "HTTP/1.1 400") == 0);
+    }
+    {
+        client c;
+        CHECK(!c.send("GET /index.html HTTP/1.0\r\n\r\n"));
+        CHECK(c.receive().compare(0, 12, "HTTP/1.1 400") == 0);
+    }
+    {
+        client c;
+        CHECK(!c.send("GET index.html HTTP/1.1\r\n\r\n"));
+        CHECK(c.receive().compare(0, 12, "HTTP/1.1 400") == 0);
+    }
+}
+
+void test_connection_close() {
+    client c;
+    CHECK(!c.send(get("/index.html", "Connection: close\r\n")));
+    CHECK(c.receive().compare(0, 15, "HTTP/1.1 200 OK") == 0);
+}
+
+// Pipelined requests already read are answered with one batch, in order
+void test_pipelined() {
+    client c;
+    CHECK(c.send(get("/index.html") + get("/missing.html") + get("/index.html")));
+    std::string response = c.receive();
+    CHECK(count(response, "HTTP/1.1 ") == 3);
+    size_t not_found = response.find("HTTP/1.1 404");
+    CHECK(not_found != std::string::npos);
+    CHECK(response.find("HTTP/1.1 200") < not_found && response.rfind("HTTP/1.1 200") > not_found);
+}
+
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    char root[] = "/tmp/test_http_parser.XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string index = std::string(root) + "/index.html";
+    FILE* fp = fopen(index.c_str(), "w");
+    fputs(INDEX, fp);
+    fclose(fp);
+
+    http_conn::m_epollfd = epoll_create(5);
+    vhost_table::start(root, 16 * 1024 * 1024);
+
+    RUN(test_get);
+    RUN(test_absolute_form);
+    RUN(test_split_request);
+    RUN(test_errors);
+    RUN(test_connection_close);
+    RUN(test_pipelined);
+
+    vhost_table::stop();
+    unlink(index.c_str());
+    rmdir(root);
+    return check_failures;
+}
@@ -5,27 +5,62 @@
 #include <list>
 #include <exception>
 #include <cstdio>
+#include <time.h>
 #include "locker.h"
+#include "probes.h"
+
+// Snapshot of the state of a thread pool
+struct pool_stats {
+    int threads;
+    int idle;
+    int busy;
+    int queued;
+    int min_threads;
+    int max_threads;
+    bool stopping;
+    unsigned long completed;
+    unsigned long rejected;
+    unsigned long spawned;
+    unsigned long retired;
+};
 
+/*
+    Elastic thread pool:
+        - min_threads threads are always running;
+        - When requests queue up faster than the idle threads take them, threads are added up to max_threads;
+        - Threads above min_threads exit after idle_timeout seconds without work;
+        - drain() stops accepting requests and waits until the queued ones have been processed and every thread has exited.
+*/
 template<typename T>
 class threadpool {
 public:
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    threadpool(int min_threads = 8, int max_threads = 8, int max_requests = 10000, int idle_timeout = 30);
     ~threadpool();
     // Add task to request queue
     bool append(T* request);
+    // Stop accepting requests, finish the queued ones and wait for all threads to exit
+    void drain();
+    pool_stats stats();
 
 private:
     static void* worker(void* arg);
     // Threadpool run task: get a task from request queue and work
     void run();
+    // Start one more thread, called with m_queuelocker held
+    bool spawn();
 
 private:
-    // Number of threads
+    // Number of running threads
     int m_thread_number;
-    
-    // Array describing the thread pool, size is m_thread_number 
-    pthread_t * m_threads;
+    int m_min_threads;
+    int m_max_threads;
+
+    // Threads waiting for a request, and threads processing one
+    int m_idle;
+    int m_busy;
+
+    // Seconds a thread above m_min_threads may stay idle
+    int m_idle_timeout;
 
     // Maximum number of requests allowed in the request queue and waiting to be processed
     int m_max_requests;
@@ -36,97 +71,165 @@ private:
     // Mutex
     locker m_queuelocker;
 
-    // Semaphore to determine whether there's tasks need to be processed
-    sem m_queuestat;
+    // Signaled when a request is queued or the pool stops
+    cond m_queuestat;
+
+    // Signaled when a thread exits
+    cond m_exitstat;
+
+    // Whether to stop accepting requests
+    bool m_stop;
 
-    // Whether to end the thread
-    bool m_stop;    
+    unsigned long m_completed;
+    unsigned long m_rejected;
+    unsigned long m_spawned;
+    unsigned long m_retired;
 };
 
 template<typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests) :
-    m_thread_number(thread_number), m_max_requests(max_requests), m_stop(false), m_threads(NULL) {
-        if ((thread_number <= 0) || (max_requests <= 0)) {
+threadpool<T>::threadpool(int min_threads, int max_threads, int max_requests, int idle_timeout) :
+    m_thread_number(0), m_min_threads(min_threads), m_max_threads(max_threads), m_idle(0), m_busy(0),
+    m_idle_timeout(idle_timeout), m_max_requests(max_requests), m_stop(false),
+    m_completed(0), m_rejected(0), m_spawned(0), m_retired(0) {
+        if ((min_threads <= 0) || (max_requests <= 0) || (idle_timeout <= 0)) {
             throw std::exception();
         }
-
-        // Create threads array
-        m_threads = new pthread_t[m_thread_number];
-        if (!m_threads) {
-            throw std::exception();
+        if (m_max_threads < m_min_threads) {
+            m_max_threads = m_min_threads;
         }
 
-        // Create thread_number threads and set them as detached threads.
-        for(int i = 0; i < thread_number; ++i) {
-            printf("create the %dth thread\n", i);
-            // worker must be a static function in C++
-            // In order for worker to access other members who are not static, pass this pointer to it as parameters
-            if (pthread_create(m_threads + i, NULL, worker, this) != 0) {
-                delete []m_threads;
-                throw std::exception();
-            }
-
-            if (pthread_detach(m_threads[i])) {
-                delete []m_threads;
+        // Create min_threads threads
+        m_queuelocker.lock();
+        for(int i = 0; i < min_threads; ++i) {
+            if (!spawn()) {
+                m_queuelocker.unlock();
+                drain();
                 throw std::exception();
             }
         }
+        m_queuelocker.unlock();
 }
 
 template<typename T>
 threadpool<T>::~threadpool() {
-    delete []m_threads;
-    m_stop = true;
+    drain();
+}
+
+template<typename T>
+bool threadpool<T>::spawn() {
+    printf("create the %dth thread\n", m_thread_number);
+    // worker must be a static function in C++
+    // In order for worker to access other members who are not static, pass this pointer to it as parameters
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker, this) != 0) {
+        return false;
+    }
+    // Threads come and go, nobody joins them: drain() waits on m_exitstat instead
+    pthread_detach(thread);
+    m_thread_number ++;
+    m_spawned ++;
+    return true;
 }
 
 template<typename T>
 bool threadpool<T>::append(T* request) {
     m_queuelocker.lock();
-    if (m_workqueue.size() > m_max_requests) {
+    if (m_stop || (int)m_workqueue.size() >= m_max_requests) {
+        m_rejected ++;
         m_queuelocker.unlock();
         return false;
     }
 
     m_workqueue.push_back(request);
+    PROBE3(enqueue, this, request, m_workqueue.size());
+    // Every idle thread will take one request, grow if the others would have to wait
+    if ((int)m_workqueue.size() > m_idle && m_thread_number < m_max_threads) {
+        spawn();
+    }
     m_queuelocker.unlock();
-    // Add semaphore
-    m_queuestat.post();
+    m_queuestat.signal();
     return true;
 
 }
 
+template<typename T>
+void threadpool<T>::drain() {
+    m_queuelocker.lock();
+    m_stop = true;
+    m_queuestat.broadcast();
+    while (m_thread_number > 0) {
+        m_exitstat.wait(m_queuelocker.get());
+    }
+    m_queuelocker.unlock();
+}
+
+template<typename T>
+pool_stats threadpool<T>::stats() {
+    m_queuelocker.lock();
+    pool_stats s;
+    s.threads = m_thread_number;
+    s.idle = m_idle;
+    s.busy = m_busy;
+    s.queued = m_workqueue.size();
+    s.min_threads = m_min_threads;
+    s.max_threads = m_max_threads;
+    s.stopping = m_stop;
+    s.completed = m_completed;
+    s.rejected = m_rejected;
+    s.spawned = m_spawned;
+    s.retired = m_retired;
+    m_queuelocker.unlock();
+    return s;
+}
+
 template<typename T>
 void threadpool<T>::run() {
-    while(!m_stop) {
-        // Whether there's a task to be processed
-        m_queuestat.wait();
-        m_queuelocker.lock();
+    m_queuelocker.lock();
+    while(true) {
+        // Wait for a task to be processed; an extra thread gives up after m_idle_timeout seconds without work
+        bool timed_out = false;
+        while (m_workqueue.empty() && !m_stop && !(timed_out && m_thread_number > m_min_threads)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += m_idle_timeout;
+            m_idle ++;
+            timed_out = !m_queuestat.timewait(m_queuelocker.get(), deadline);
+            m_idle --;
+        }
 
+        // Stopped and drained, or idle for too long
         if (m_workqueue.empty()) {
-            m_queuelocker.unlock();
-            continue;
+            break;
         }
 
         T* request = m_workqueue.front();
         m_workqueue.pop_front();
+        PROBE3(dequeue, this, request, m_workqueue.size());
+        m_busy ++;
         m_queuelocker.unlock();
 
-        if (!request) {
-            continue;
+        if (request) {
+            request->process();
         }
 
-        request->process();
-
+        m_queuelocker.lock();
+        m_busy --;
+        m_completed ++;
     }
+
+    m_thread_number --;
+    m_retired ++;
+    m_exitstat.broadcast();
+    m_queuelocker.unlock();
 }
 
 
 template<typename T>
 void* threadpool<T>::worker(void* arg){
-    // Convert this pointer 
+    // Convert this pointer
     threadpool* pool = (threadpool*) arg;
     pool->run();
     return pool;
 }
 
-#endif
\ No newline at end of file
+#endif
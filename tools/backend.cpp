@@ -0,0 +1,148 @@
+/*
+    Stand-in upstream for testing the reverse proxy: a thread per connection, HTTP/1.1 keep-alive.
+        .../bytes/N     N bytes with Content-Length
+        .../chunked/N   N bytes with chunked transfer encoding
+        .../close/N     N bytes delimited by closing the connection
+        anything else   a short text naming the path and the X-Forwarded-For of the request
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+
+static int delay_ms = 0;
+
+static bool send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Send the response to one request, returns false if the connection must be closed
+static bool respond(int fd, const std::string& request) {
+    char path[1024] = "/";
+    sscanf(request.c_str(), "%*s %1023s", path);
+    const char* ff = strcasestr(request.c_str(), "\r\nX-Forwarded-For:");
+    std::string forwarded;
+    if (ff) {
+        ff += 18 + strspn(ff + 18, " ");
+        forwarded.assign(ff, strcspn(ff, "\r"));
+    }
+    bool keep_alive = !strcasestr(request.c_str(), "\r\nConnection: close");
+
+    if (delay_ms > 0) {
+        usleep(delay_ms * 1000);
+    }
+
+    const char* p;
+    char header[256];
+    if ((p = strstr(path, "/bytes/"))) {
+        long n = atol(p + 7);
+        snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\nContent-Type: application/octet-stream\r\n\r\n", n);
+        std::string body(n, 'x');
+        return send_all(fd, header, strlen(header)) && send_all(fd, body.data(), n) && keep_alive;
+    }
+    if ((p = strstr(path, "/chunked/"))) {
+        long n = atol(p + 9);
+        snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nContent-Type: application/octet-stream\r\n\r\n");
+        std::string body = header;
+        while (n > 0) {
+            long len = n < 1000 ? n : 1000;
+            char size[32];
+            snprintf(size, sizeof(size), "%lx\r\n", len);
+            body += size;
+            body.append(len, 'c');
+            body += "\r\n";
+            n -= len;
+        }
+        body += "0\r\n\r\n";
+        return send_all(fd, body.data(), body.size()) && keep_alive;
+    }
+    if ((p = strstr(path, "/close/"))) {
+        long n = atol(p + 7);
+        snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n");
+        std::string body(n, 'z');
+        send_all(fd, header, strlen(header));
+        send_all(fd, body.data(), n);
+        return false;
+    }
+
+    std::string body = std::string("upstream: ") + path + " for " + forwarded + "\n";
+    snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nContent-Type: text/plain\r\n\r\n", body.size());
+    return send_all(fd, header, strlen(header)) && send_all(fd, body.data(), body.size()) && keep_alive;
+}
+
+static void* serve(void* arg) {
+    int fd = (int)(long)arg;
+    std::string buf;
+    char data[4096];
+    while (true) {
+        size_t end = buf.find("\r\n\r\n");
+        if (end != std::string::npos) {
+            std::string request = buf.substr(0, end + 4);
+            buf.erase(0, end + 4);
+            if (!respond(fd, request)) {
+                break;
+            }
+            continue;
+        }
+        ssize_t n = recv(fd, data, sizeof(data), 0);
+        if (n <= 0) {
+            break;
+        }
+        buf.append(data, n);
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        if (opt == 'd') {
+            delay_ms = atoi(optarg);
+        } else {
+            printf("usage: %s [-d delay_ms] port\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        printf("usage: %s [-d delay_ms] port\n", argv[0]);
+        return 1;
+    }
+
+    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(atoi(argv[optind]));
+    if (bind(listenfd, (sockaddr*)&address, sizeof(address)) < 0 || listen(listenfd, 128) < 0) {
+        perror("bind");
+        return 1;
+    }
+
+    while (true) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        pthread_t tid;
+        pthread_create(&tid, NULL, serve, (void*)(long)fd);
+        pthread_detach(tid);
+    }
+}
@@ -0,0 +1,344 @@
+/*
+    HTTP load generator:
+        Every thread drives its share of the connections with a non-blocking epoll loop;
+        every connection sends one request at a time (keep-alive by default) and picks the path from a weighted request mix.
+    Prints throughput and the latency distribution.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#define MAX_EVENT_NUMBER 1024
+#define RESPONSE_BUFFER_SIZE 65536
+
+// One entry of the request mix
+struct mix_entry {
+    std::string path;
+    int weight;
+};
+
+struct connection {
+    int fd;
+    // Request line and headers of the current request
+    std::string request;
+    size_t sent;
+    // Response header collected so far, the body is only counted
+    std::string header;
+    bool header_done;
+    long body_left;
+    bool close_after;
+    int status;
+    uint64_t start_ns;
+};
+
+struct worker_args {
+    int connections;
+    unsigned int seed;
+    // Results
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long non_2xx;
+    unsigned long bytes;
+    std::vector<uint32_t> latencies_us;
+};
+
+static sockaddr_in server_address;
+static const char* host_header = "localhost";
+static std::vector<mix_entry> mix;
+static int total_weight = 0;
+static bool keep_alive = true;
+static volatile bool running = true;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const std::string& pick_path(unsigned int* seed) {
+    int r = rand_r(seed) % total_weight;
+    for (const mix_entry& e : mix) {
+        if (r < e.weight) {
+            return e.path;
+        }
+        r -= e.weight;
+    }
+    return mix.back().path;
+}
+
+static bool open_connection(int epollfd, connection* c) {
+    c->fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (sockaddr*)&server_address, sizeof(server_address)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+    return true;
+}
+
+static void close_connection(connection* c) {
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static void start_request(connection* c, unsigned int* seed) {
+    c->request = "GET " + pick_path(seed) + " HTTP/1.1\r\nHost: " + host_header + "\r\nConnection: "
+        + (keep_alive ? "keep-alive" : "close") + "\r\n\r\n";
+    c->sent = 0;
+    c->header.clear();
+    c->header_done = false;
+    c->body_left = 0;
+    c->close_after = !keep_alive;
+    c->start_ns = now_ns();
+}
+
+// Look at the complete response header: status and body length
+static void parse_header(connection* c) {
+    c->status = 0;
+    sscanf(c->header.c_str(), "HTTP/%*s %d", &c->status);
+    c->body_left = 0;
+    const char* h = c->header.c_str();
+    const char* p = strcasestr(h, "\r\nContent-Length:");
+    if (p) {
+        c->body_left = atol(p + 17);
+    }
+    if (strcasestr(h, "\r\nConnection: close")) {
+        c->close_after = true;
+    }
+}
+
+static void* worker(void* arg) {
+    worker_args* args = (worker_args*)arg;
+    int epollfd = epoll_create(5);
+    std::vector<connection> conns(args->connections);
+    static thread_local char buf[RESPONSE_BUFFER_SIZE];
+
+    for (connection& c : conns) {
+        c.fd = -1;
+        if (open_connection(epollfd, &c)) {
+            start_request(&c, &args->seed);
+        } else {
+            args->errors ++;
+        }
+    }
+
+    epoll_event events[MAX_EVENT_NUMBER];
+    while (running) {
+        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, 100);
+        for (int i = 0; i < num && running; ++i) {
+            connection* c = (connection*)events[i].data.ptr;
+            bool failed = false;
+
+            // Send the rest of the request
+            if (c->sent < c->request.size() && (events[i].events & EPOLLOUT)) {
+                ssize_t n = send(c->fd, c->request.data() + c->sent, c->request.size() - c->sent, MSG_NOSIGNAL);
+                if (n > 0) {
+                    c->sent += n;
+                    if (c->sent == c->request.size()) {
+                        epoll_event ev;
+                        ev.events = EPOLLIN;
+                        ev.data.ptr = c;
+                        epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+                    }
+                } else if (n < 0 && errno != EAGAIN) {
+                    failed = true;
+                }
+            }
+
+            // Read the response
+            bool done = false;
+            while (!failed && !done && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+                if (n < 0) {
+                    if (errno != EAGAIN) {
+                        failed = true;
+                    }
+                    break;
+                }
+                if (n == 0) {
+                    failed = true;
+                    break;
+                }
+                args->bytes += n;
+                size_t body = n;
+                if (!c->header_done) {
+                    c->header.append(buf, n);
+                    size_t end = c->header.find("\r\n\r\n");
+                    if (end == std::string::npos) {
+                        continue;
+                    }
+                    body = c->header.size() - (end + 4);
+                    c->header.resize(end + 4);
+                    c->header_done = true;
+                    parse_header(c);
+                }
+                c->body_left -= body;
+                if (c->body_left <= 0) {
+                    done = true;
+                }
+            }
+
+            if (done) {
+                args->requests ++;
+                if (c->status < 200 || c->status >= 300) {
+                    args->non_2xx ++;
+                }
+                args->latencies_us.push_back((now_ns() - c->start_ns) / 1000);
+                if (c->close_after) {
+                    close_connection(c);
+                    if (!open_connection(epollfd, c)) {
+                        args->errors ++;
+                        continue;
+                    }
+                } else {
+                    epoll_event ev;
+                    ev.events = EPOLLOUT | EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+                }
+                start_request(c, &args->seed);
+            } else if (failed) {
+                args->errors ++;
+                close_connection(c);
+                if (open_connection(epollfd, c)) {
+                    start_request(c, &args->seed);
+                }
+            }
+        }
+    }
+
+    for (connection& c : conns) {
+        close_connection(&c);
+    }
+    close(epollfd);
+    return NULL;
+}
+
+static bool load_mix(const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        perror("fopen");
+        return false;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        int weight;
+        char target[1000];
+        if (line[0] == '#' || sscanf(line, "%d %999s", &weight, target) != 2 || weight <= 0) {
+            continue;
+        }
+        mix.push_back({target, weight});
+    }
+    fclose(fp);
+    return !mix.empty();
+}
+
+static void usage(const char* prog) {
+    printf("usage: %s [-c connections] [-t threads] [-d seconds] [-m mix_file] [-K] host port\n", prog);
+    printf("    -c    concurrent connections (default 64)\n");
+    printf("    -t    client threads (default 2)\n");
+    printf("    -d    duration in seconds (default 10)\n");
+    printf("    -m    request mix, one \"<weight> <path>\" per line (default: /index.html, /images/image1.jpg and a 404)\n");
+    printf("    -K    close the connection after every response instead of keep-alive\n");
+}
+
+int main(int argc, char* argv[]) {
+    int connections = 64;
+    int threads = 2;
+    int duration = 10;
+    const char* mix_file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:d:m:K")) != -1) {
+        switch (opt) {
+            case 'c': connections = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'm': mix_file = optarg; break;
+            case 'K': keep_alive = false; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind + 2 > argc || connections <= 0 || threads <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (threads > connections) {
+        threads = connections;
+    }
+
+    host_header = argv[optind];
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, host_header, &server_address.sin_addr) != 1) {
+        printf("host must be an IPv4 address\n");
+        return 1;
+    }
+
+    if (mix_file) {
+        if (!load_mix(mix_file)) {
+            return 1;
+        }
+    } else {
+        mix = {{"/index.html", 60}, {"/images/image1.jpg", 30}, {"/missing.html", 10}};
+    }
+    for (const mix_entry& e : mix) {
+        total_weight += e.weight;
+    }
+
+    std::vector<worker_args> args(threads);
+    std::vector<pthread_t> tids(threads);
+    for (int i = 0; i < threads; ++i) {
+        args[i].connections = connections / threads + (i < connections % threads ? 1 : 0);
+        args[i].seed = 12345 + i;
+        args[i].requests = args[i].errors = args[i].non_2xx = args[i].bytes = 0;
+        pthread_create(&tids[i], NULL, worker, &args[i]);
+    }
+    sleep(duration);
+    running = false;
+
+    unsigned long requests = 0, errors = 0, non_2xx = 0, bytes = 0;
+    std::vector<uint32_t> latencies;
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+        requests += args[i].requests;
+        errors += args[i].errors;
+        non_2xx += args[i].non_2xx;
+        bytes += args[i].bytes;
+        latencies.insert(latencies.end(), args[i].latencies_us.begin(), args[i].latencies_us.end());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) -> uint32_t {
+        return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))];
+    };
+
+    printf("%lu requests in %ds, %lu errors, %lu non-2xx\n", requests, duration, errors, non_2xx);
+    printf("Requests/sec: %.1f\n", (double)requests / duration);
+    printf("Transfer/sec: %.2f MB\n", (double)bytes / duration / (1024 * 1024));
+    printf("Latency (us): p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n",
+        percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), latencies.empty() ? 0 : latencies.back());
+    return 0;
+}
@@ -0,0 +1,218 @@
+/*
+    Offline packer: writes every readable regular file under a document root into one archive for the server's -a option.
+    The URL of a file is its path relative to the root, e.g. root/images/a.png is /images/a.png.
+    See pack.h for the layout.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "../pack.h"
+
+#define PAGE_SIZE 4096
+
+struct input_file {
+    std::string path;
+    std::string url;
+    uint64_t size;
+};
+
+static std::vector<input_file> files;
+static size_t root_len;
+
+static const char* content_type(const std::string& url) {
+    static const char* types[][2] = {
+        {".html", "text/html"}, {".htm", "text/html"}, {".css", "text/css"}, {".js", "application/javascript"},
+        {".json", "application/json"}, {".txt", "text/plain"}, {".xml", "application/xml"}, {".svg", "image/svg+xml"},
+        {".png", "image/png"}, {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"}, {".gif", "image/gif"},
+        {".ico", "image/x-icon"}, {".webp", "image/webp"}, {".pdf", "application/pdf"}, {".mp4", "video/mp4"},
+        {".woff", "font/woff"}, {".woff2", "font/woff2"}, {".wasm", "application/wasm"},
+    };
+    size_t dot = url.rfind('.');
+    if (dot != std::string::npos && url.find('/', dot) == std::string::npos) {
+        for (auto& t : types) {
+            if (strcasecmp(url.c_str() + dot, t[0]) == 0) {
+                return t[1];
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+static int collect(const char* path, const struct stat* st, int type, struct FTW*) {
+    // Same rule as the server: only files readable by others are served
+    if (type == FTW_F && S_ISREG(st->st_mode) && (st->st_mode & S_IROTH)) {
+        files.push_back({path, path + root_len, (uint64_t)st->st_size});
+    }
+    return 0;
+}
+
+static bool write_all(int fd, const void* data, size_t len, uint64_t offset) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// Copy a file into the archive and hash its contents for the ETag
+static bool copy_file(int out, const input_file& f, uint64_t offset, uint64_t* hash) {
+    int in = open(f.path.c_str(), O_RDONLY);
+    if (in < 0) {
+        perror(f.path.c_str());
+        return false;
+    }
+    char buf[65536];
+    uint64_t h = 14695981039346656037ull;
+    uint64_t done = 0;
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; ++i) {
+            h ^= (unsigned char)buf[i];
+            h *= 1099511628211ull;
+        }
+        if (!write_all(out, buf, n, offset + done)) {
+            close(in);
+            return false;
+        }
+        done += n;
+    }
+    close(in);
+    if (n < 0 || done != f.size) {
+        printf("%s changed while packing\n", f.path.c_str());
+        return false;
+    }
+    *hash = h;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    const char* output = "site.pack";
+    int opt;
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        if (opt == 'o') {
+            output = optarg;
+        } else {
+            printf("usage: %s [-o archive] doc_root\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        printf("usage: %s [-o archive] doc_root\n", argv[0]);
+        return 1;
+    }
+
+    std::string root = argv[optind];
+    while (root.size() > 1 && root.back() == '/') {
+        root.pop_back();
+    }
+    root_len = root.size();
+    if (nftw(root.c_str(), collect, 64, FTW_PHYS) != 0) {
+        perror(root.c_str());
+        return 1;
+    }
+    std::sort(files.begin(), files.end(), [](const input_file& a, const input_file& b) { return a.url < b.url; });
+
+    // 1. Layout: header, entries, buckets, strings, then the payloads on page boundaries
+    pack_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+    header.count = files.size();
+    header.buckets = 2;
+    while (header.buckets < 2 * header.count) {
+        header.buckets *= 2;
+    }
+    header.entries_offset = sizeof(pack_header);
+    header.buckets_offset = header.entries_offset + header.count * sizeof(pack_entry);
+    header.strings_offset = header.buckets_offset + header.buckets * sizeof(uint32_t);
+
+    std::vector<pack_entry> entries(files.size());
+    std::string strings;
+    for (size_t i = 0; i < files.size(); ++i) {
+        entries[i].url_offset = strings.size();
+        entries[i].url_len = files[i].url.size();
+        strings += files[i].url;
+    }
+    // The header blocks need the ETags, so they are appended once the payloads are hashed
+    std::vector<uint64_t> hashes(files.size());
+
+    std::string tmp = std::string(output) + ".tmp";
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror(tmp.c_str());
+        return 1;
+    }
+
+    // 2. Header blocks, sized before the payload offsets are known: ETags have a fixed length
+    size_t strings_size = strings.size();
+    for (size_t i = 0; i < files.size(); ++i) {
+        char block[256];
+        int len = snprintf(block, sizeof(block), "Content-Length: %llu\r\nContent-Type: %s\r\nETag: \"%016llx\"\r\n",
+            (unsigned long long)files[i].size, content_type(files[i].url), 0ull);
+        strings_size += len;
+    }
+    uint64_t data_offset = (header.strings_offset + strings_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+
+    // 3. Payloads
+    for (size_t i = 0; i < files.size(); ++i) {
+        entries[i].data_offset = data_offset;
+        entries[i].size = files[i].size;
+        if (!copy_file(out, files[i], data_offset, &hashes[i])) {
+            close(out);
+            unlink(tmp.c_str());
+            return 1;
+        }
+        data_offset = (data_offset + files[i].size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    }
+    header.size = data_offset;
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        snprintf(entries[i].etag, sizeof(entries[i].etag), "\"%016llx\"", (unsigned long long)hashes[i]);
+        char block[256];
+        int len = snprintf(block, sizeof(block), "Content-Length: %llu\r\nContent-Type: %s\r\nETag: %s\r\n",
+            (unsigned long long)files[i].size, content_type(files[i].url), entries[i].etag);
+        entries[i].header_offset = strings.size();
+        entries[i].header_len = len;
+        strings.append(block, len);
+    }
+
+    // 4. Hash index
+    std::vector<uint32_t> buckets(header.buckets, 0);
+    uint32_t mask = header.buckets - 1;
+    for (size_t i = 0; i < files.size(); ++i) {
+        entries[i].hash = pack_hash(files[i].url.data(), files[i].url.size());
+        uint32_t b = entries[i].hash & mask;
+        while (buckets[b] != 0) {
+            b = (b + 1) & mask;
+        }
+        buckets[b] = i + 1;
+    }
+
+    bool ok = write_all(out, &header, sizeof(header), 0)
+        && write_all(out, entries.data(), entries.size() * sizeof(pack_entry), header.entries_offset)
+        && write_all(out, buckets.data(), buckets.size() * sizeof(uint32_t), header.buckets_offset)
+        && write_all(out, strings.data(), strings.size(), header.strings_offset)
+        && ftruncate(out, header.size) == 0 && fsync(out) == 0;
+    close(out);
+    // Replace the old archive in one step
+    if (!ok || rename(tmp.c_str(), output) < 0) {
+        perror(output);
+        unlink(tmp.c_str());
+        return 1;
+    }
+    printf("%s: %u files, %llu bytes\n", output, header.count, (unsigned long long)header.size);
+    return 0;
+}
@@ -0,0 +1,476 @@
+/*
+    Replay of a capture written by the server's -k option (see capture.h):
+        every captured connection is opened again at its recorded time and sends what the client sent, at the recorded
+        times scaled by -s. Like the original client, a connection sends its next request only once the response to the
+        previous one is in: at higher speeds the gaps shrink, but the requests of a connection stay in order on it.
+    Prints the latency distribution. With -j the capture is printed as JSON lines instead.
+    HTTP/2 connections are recorded only up to the switch, they are skipped, and so are the connections the server cut
+    short by dropping a record.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include "../capture.h"
+
+#define MAX_EVENT_NUMBER 1024
+#define RESPONSE_BUFFER_SIZE 65536
+
+struct chunk {
+    uint64_t time_us;
+    std::string data;
+};
+
+struct session {
+    uint32_t id;
+    uint64_t open_us;
+    // UINT64_MAX if the close wasn't recorded
+    uint64_t close_us;
+    // A record of it was dropped, the rest of its traffic is missing
+    bool dropped;
+    std::vector<chunk> chunks;
+    // Next chunk to send
+    size_t next;
+    int fd;
+    bool done;
+    // Bytes queued for the socket
+    std::string out;
+    size_t out_pos;
+    // Progress through the "\r\n\r\n" that ends a request, and whether a request has been started but not ended
+    int match;
+    bool in_request;
+    // Send times of the requests waiting for their response
+    std::deque<uint64_t> started;
+    // Response header collected so far, the body is only counted
+    std::string header;
+    bool header_done;
+    long body_left;
+    int status;
+};
+
+static sockaddr_in server_address;
+static int epollfd;
+static unsigned long requests = 0, responses = 0, errors = 0, non_2xx = 0;
+static std::vector<uint32_t> latencies_us;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const char* type_names[] = {"open", "data", "close", "dropped"};
+
+// Walk the records of a capture file; returns false if it isn't one
+template <typename F>
+static bool read_capture(const char* path, capture_header* header, F&& on_record) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return false;
+    }
+    if (fread(header, sizeof(*header), 1, fp) != 1 || memcmp(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) {
+        printf("%s is not a capture file\n", path);
+        fclose(fp);
+        return false;
+    }
+    capture_record r;
+    std::string data;
+    while (fread(&r, sizeof(r), 1, fp) == 1) {
+        data.resize(r.len);
+        if (r.len && fread(&data[0], 1, r.len, fp) != r.len) {
+            printf("%s: truncated record\n", path);
+            break;
+        }
+        on_record(r, data);
+    }
+    fclose(fp);
+    return true;
+}
+
+static bool dump_json(const char* path) {
+    capture_header header;
+    return read_capture(path, &header, [&](const capture_record& r, const std::string& data) {
+        printf("{\"time_us\": %llu, \"conn\": %u, \"type\": \"%s\"", (unsigned long long)(header.start_us + r.time_us), r.conn,
+            r.type <= capture_record::DROPPED ? type_names[r.type] : "unknown");
+        if (r.type == capture_record::DATA) {
+            printf(", \"data\": \"");
+            for (unsigned char c : data) {
+                if (c == '"' || c == '\\') {
+                    printf("\\%c", c);
+                } else if (c == '\r') {
+                    printf("\\r");
+                } else if (c == '\n') {
+                    printf("\\n");
+                } else if (c < 0x20 || c >= 0x7f) {
+                    printf("\\u%04x", c);
+                } else {
+                    putchar(c);
+                }
+            }
+            printf("\"");
+        }
+        printf("}\n");
+    });
+}
+
+static bool load(const char* path, std::vector<session>* sessions, uint64_t* span_us, int* skipped, int* dropped) {
+    capture_header header;
+    std::unordered_map<uint32_t, size_t> index;
+    *span_us = 0;
+    bool ok = read_capture(path, &header, [&](const capture_record& r, const std::string& data) {
+        *span_us = r.time_us;
+        if (r.type == capture_record::OPEN) {
+            session s;
+            s.id = r.conn;
+            s.open_us = r.time_us;
+            s.close_us = UINT64_MAX;
+            s.dropped = false;
+            index[r.conn] = sessions->size();
+            sessions->push_back(s);
+            return;
+        }
+        // Records of a connection whose OPEN was dropped can't be replayed
+        auto it = index.find(r.conn);
+        if (it == index.end()) {
+            return;
+        }
+        session& s = (*sessions)[it->second];
+        if (r.type == capture_record::DATA) {
+            s.chunks.push_back({r.time_us, data});
+        } else if (r.type == capture_record::CLOSE) {
+            s.close_us = r.time_us;
+            index.erase(it);
+        } else if (r.type == capture_record::DROPPED) {
+            s.dropped = true;
+            index.erase(it);
+        }
+    });
+
+    // HTTP/2 with prior knowledge or through an upgrade
+    *skipped = 0;
+    *dropped = 0;
+    std::vector<session> kept;
+    for (session& s : *sessions) {
+        if (s.dropped) {
+            ++*dropped;
+            continue;
+        }
+        bool h2 = false;
+        for (const chunk& c : s.chunks) {
+            if (c.data.compare(0, 14, "PRI * HTTP/2.0") == 0 || strcasestr(c.data.c_str(), "\r\nUpgrade: h2c")) {
+                h2 = true;
+                break;
+            }
+        }
+        if (h2) {
+            ++*skipped;
+        } else {
+            kept.push_back(std::move(s));
+        }
+    }
+    sessions->swap(kept);
+    return ok;
+}
+
+static void finish(session* s) {
+    if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    s->done = true;
+}
+
+static bool open_session(session* s) {
+    s->next = 0;
+    s->done = false;
+    s->out_pos = 0;
+    s->match = 0;
+    s->in_request = false;
+    s->header_done = false;
+    s->body_left = 0;
+    s->status = 0;
+    s->fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (s->fd < 0) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // A local server: a blocking connect is quick, and the socket is non-blocking from then on
+    if (connect(s->fd, (sockaddr*)&server_address, sizeof(server_address)) < 0) {
+        close(s->fd);
+        s->fd = -1;
+        return false;
+    }
+    fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, s->fd, &ev);
+    return true;
+}
+
+// Write what's queued; waits for EPOLLOUT if the socket is full
+static bool flush(session* s) {
+    while (s->out_pos < s->out.size()) {
+        ssize_t n = send(s->fd, s->out.data() + s->out_pos, s->out.size() - s->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                return false;
+            }
+            epoll_event ev;
+            ev.events = EPOLLIN | EPOLLOUT;
+            ev.data.ptr = s;
+            epoll_ctl(epollfd, EPOLL_CTL_MOD, s->fd, &ev);
+            return true;
+        }
+        s->out_pos += n;
+    }
+    if (!s->out.empty()) {
+        s->out.clear();
+        s->out_pos = 0;
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, s->fd, &ev);
+    }
+    return true;
+}
+
+// Queue the chunks that are due at virtual time v, and close the connection once it's done; *wake is the next due time
+static void advance(session* s, uint64_t v, uint64_t* wake) {
+    while (s->next < s->chunks.size()) {
+        const chunk& c = s->chunks[s->next];
+        if (c.time_us > v) {
+            *wake = std::min(*wake, c.time_us);
+            break;
+        }
+        // A new request waits for the responses to the previous ones, the response event continues it
+        if (!s->started.empty() && !s->in_request) {
+            break;
+        }
+        s->out += c.data;
+        for (char ch : c.data) {
+            s->in_request = true;
+            s->match = (ch == "\r\n\r\n"[s->match]) ? s->match + 1 : (ch == '\r' ? 1 : 0);
+            if (s->match == 4) {
+                s->match = 0;
+                s->in_request = false;
+                s->started.push_back(now_us());
+                requests ++;
+            }
+        }
+        s->next ++;
+    }
+    if (!flush(s)) {
+        errors += s->started.size();
+        finish(s);
+        return;
+    }
+    if (s->next == s->chunks.size() && s->started.empty() && s->out.empty()) {
+        if (s->close_us != UINT64_MAX && s->close_us > v) {
+            *wake = std::min(*wake, s->close_us);
+        } else {
+            finish(s);
+        }
+    }
+}
+
+static void parse_header(session* s) {
+    s->status = 0;
+    sscanf(s->header.c_str(), "HTTP/%*s %d", &s->status);
+    s->body_left = 0;
+    const char* p = strcasestr(s->header.c_str(), "\r\nContent-Length:");
+    if (p && s->status != 304) {
+        s->body_left = atol(p + 17);
+    }
+}
+
+static void on_response(session* s) {
+    responses ++;
+    if (s->status < 200 || s->status >= 400) {
+        non_2xx ++;
+    }
+    if (!s->started.empty()) {
+        latencies_us.push_back(now_us() - s->started.front());
+        s->started.pop_front();
+    }
+}
+
+static void on_readable(session* s) {
+    static char buf[RESPONSE_BUFFER_SIZE];
+    while (true) {
+        ssize_t n = recv(s->fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                errors += s->started.size();
+                finish(s);
+            }
+            return;
+        }
+        if (n == 0) {
+            // Closed by the server: fine once every request has its response (Connection: close)
+            errors += s->started.size();
+            finish(s);
+            return;
+        }
+        const char* p = buf;
+        while (n > 0) {
+            if (!s->header_done) {
+                size_t old = s->header.size();
+                s->header.append(p, n);
+                size_t end = s->header.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+                if (end == std::string::npos) {
+                    break;
+                }
+                size_t used = end + 4 - old;
+                p += used;
+                n -= used;
+                s->header.resize(end + 4);
+                parse_header(s);
+                s->header_done = true;
+            }
+            long take = std::min((long)n, s->body_left);
+            s->body_left -= take;
+            p += take;
+            n -= take;
+            if (s->body_left == 0) {
+                on_response(s);
+                s->header.clear();
+                s->header_done = false;
+            }
+        }
+    }
+}
+
+static void usage(const char* prog) {
+    printf("usage: %s [-s speed] capture_file host port\n", prog);
+    printf("       %s -j capture_file\n", prog);
+    printf("    -s    replay speed, 2 replays twice as fast (default 1, 0 sends every request as soon as it can)\n");
+    printf("    -j    print the capture as JSON lines\n");
+}
+
+int main(int argc, char* argv[]) {
+    double speed = 1;
+    bool json = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:j")) != -1) {
+        switch (opt) {
+            case 's': speed = atof(optarg); break;
+            case 'j': json = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (json) {
+        if (optind >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        return dump_json(argv[optind]) ? 0 : 1;
+    }
+    if (optind + 3 > argc || speed < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(atoi(argv[optind + 2]));
+    if (inet_pton(AF_INET, argv[optind + 1], &server_address.sin_addr) != 1) {
+        printf("host must be an IPv4 address\n");
+        return 1;
+    }
+
+    std::vector<session> sessions;
+    uint64_t span_us;
+    int skipped, dropped;
+    if (!load(argv[optind], &sessions, &span_us, &skipped, &dropped)) {
+        return 1;
+    }
+    std::stable_sort(sessions.begin(), sessions.end(), [](const session& a, const session& b) { return a.open_us < b.open_us; });
+
+    epollfd = epoll_create(5);
+    epoll_event events[MAX_EVENT_NUMBER];
+    std::vector<session*> live;
+    size_t next_open = 0;
+    uint64_t start = now_us();
+    // Virtual time: the capture's clock, running speed times as fast
+    auto virtual_now = [&]() -> uint64_t {
+        return speed > 0 ? (uint64_t)((now_us() - start) * speed) : UINT64_MAX;
+    };
+
+    while (next_open < sessions.size() || !live.empty()) {
+        uint64_t v = virtual_now();
+        while (next_open < sessions.size() && sessions[next_open].open_us <= v) {
+            session* s = &sessions[next_open++];
+            if (open_session(s)) {
+                live.push_back(s);
+            } else {
+                errors ++;
+            }
+        }
+
+        uint64_t wake = UINT64_MAX;
+        if (next_open < sessions.size()) {
+            wake = sessions[next_open].open_us;
+        }
+        for (size_t i = 0; i < live.size(); ) {
+            advance(live[i], v, &wake);
+            if (live[i]->done) {
+                live[i] = live.back();
+                live.pop_back();
+            } else {
+                ++i;
+            }
+        }
+        if (next_open == sessions.size() && live.empty()) {
+            break;
+        }
+
+        int timeout = -1;
+        if (wake != UINT64_MAX) {
+            timeout = speed > 0 && wake > v ? (int)((wake - v) / speed / 1000) + 1 : 0;
+        }
+        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, timeout);
+        for (int i = 0; i < num; ++i) {
+            session* s = (session*)events[i].data.ptr;
+            if (s->done) {
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && !flush(s)) {
+                errors += s->started.size();
+                finish(s);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                on_readable(s);
+            }
+        }
+    }
+    double elapsed = (now_us() - start) / 1e6;
+    close(epollfd);
+
+    std::sort(latencies_us.begin(), latencies_us.end());
+    auto percentile = [&](double p) -> uint32_t {
+        return latencies_us.empty() ? 0 : latencies_us[std::min(latencies_us.size() - 1, (size_t)(p * latencies_us.size()))];
+    };
+    printf("%zu connections, %lu requests in %.2fs (captured over %.2fs), %d HTTP/2 connections skipped, %d cut short\n",
+        sessions.size(), requests, elapsed, span_us / 1e6, skipped, dropped);
+    printf("%lu responses, %lu errors, %lu non-2xx/3xx\n", responses, errors, non_2xx);
+    printf("Latency (us): p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n",
+        percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), latencies_us.empty() ? 0 : latencies_us.back());
+    return 0;
+}
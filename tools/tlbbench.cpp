@@ -0,0 +1,185 @@
+/*
+    dTLB benchmark of the connection table layouts:
+        legacy      65536 connections of ~3.5 KB with embedded buffers, 4 KB pages (the old `new http_conn[MAX_FD]`)
+        split-4k    256-byte connections and pooled buffers, 4 KB pages
+        split-huge  256-byte connections and pooled buffers, 2 MB pages (what the server does now)
+    Every event picks a random open connection, updates its hot fields and reads the start of its read buffer,
+    like the main loop and a worker handling an EPOLLIN. Prints ns per event and dTLB load misses when perf events are allowed.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include <vector>
+#include "../hugepage.h"
+#include "../http_conn.h"
+
+#define MAX_FD 65536
+// The buffer block of a connection, as carved from http_conn::m_buffers
+#define BUFFERS_SIZE (http_conn::READ_BUFFER_SIZE + http_conn::WRITE_BUFFER_SIZE + http_conn::FILENAME_LEN \
+    + http_conn::BATCH_STATE_LEN)
+
+// Old layout: hot fields scattered around the embedded buffers
+struct legacy_conn {
+    int sockfd;
+    char read_buf[http_conn::READ_BUFFER_SIZE];
+    int read_idx;
+    int checked_idx;
+    int state;
+    char other[300];
+    char write_buf[http_conn::WRITE_BUFFER_SIZE];
+    int write_idx;
+    int bytes_to_send;
+};
+
+// New layout: hot fields first, buffers elsewhere
+struct alignas(64) split_conn {
+    int sockfd;
+    int state;
+    int read_idx;
+    int checked_idx;
+    int write_idx;
+    int bytes_to_send;
+    char* read_buf;
+    char* write_buf;
+    char cold[200];
+};
+
+static int perf_open() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Random open fds, like a busy server with `active` clients
+static std::vector<int> pick(int active, unsigned seed) {
+    std::vector<int> fds(MAX_FD);
+    for (int i = 0; i < MAX_FD; ++i) {
+        fds[i] = i;
+    }
+    srand(seed);
+    for (int i = 0; i < active; ++i) {
+        std::swap(fds[i], fds[i + rand() % (MAX_FD - i)]);
+    }
+    fds.resize(active);
+    return fds;
+}
+
+static void* small_pages(size_t bytes) {
+    void* p = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    madvise(p, bytes, MADV_NOHUGEPAGE);
+    return p;
+}
+
+template <typename F>
+static void run(const char* name, const std::vector<int>& fds, long events, int perf_fd, F&& event) {
+    unsigned x = 12345;
+    long sum = 0;
+    // Warm up: fault everything in
+    for (size_t i = 0; i < fds.size(); ++i) {
+        sum += event(fds[i]);
+    }
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double start = now();
+    for (long i = 0; i < events; ++i) {
+        x = x * 1103515245 + 12345;
+        sum += event(fds[(x >> 8) % fds.size()]);
+    }
+    double elapsed = now() - start;
+    long long misses = -1;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+    }
+    if (misses >= 0) {
+        printf("%-11s %7.2f ns/event  %7.3f dTLB misses/event  (%ld)\n", name, elapsed * 1e9 / events, (double)misses / events, sum & 1);
+    } else {
+        printf("%-11s %7.2f ns/event  dTLB misses n/a  (%ld)\n", name, elapsed * 1e9 / events, sum & 1);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int active = 10000;
+    long events = 20000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:n:")) != -1) {
+        if (opt == 'a') {
+            active = atoi(optarg);
+        } else if (opt == 'n') {
+            events = atol(optarg);
+        } else {
+            printf("usage: %s [-a active_connections] [-n events]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (active < 1 || active > MAX_FD) {
+        active = MAX_FD;
+    }
+    std::vector<int> fds = pick(active, 1);
+    int perf_fd = perf_open();
+    if (perf_fd < 0) {
+        perror("perf_event_open: dTLB counts unavailable (no PMU, or kernel.perf_event_paranoid too high)");
+    }
+    printf("%d of %d connections active, %ld events, sizeof legacy %zu, split %zu\n",
+        active, MAX_FD, events, sizeof(legacy_conn), sizeof(split_conn));
+
+    // 1. Old layout
+    legacy_conn* legacy = (legacy_conn*)small_pages(sizeof(legacy_conn) * MAX_FD);
+    run("legacy", fds, events, perf_fd, [&](int fd) {
+        legacy_conn& c = legacy[fd];
+        c.state ^= 1;
+        c.read_idx += c.read_buf[c.checked_idx & 63];
+        c.bytes_to_send = c.write_idx + c.sockfd;
+        return c.read_idx;
+    });
+    munmap(legacy, sizeof(legacy_conn) * MAX_FD);
+
+    // 2./3. New layout, with and without huge pages; buffers are handed out in accept order like the pool does
+    for (int huge = 0; huge < 2; ++huge) {
+        size_t table_bytes = sizeof(split_conn) * MAX_FD;
+        size_t buffer_bytes = (size_t)BUFFERS_SIZE * active;
+        split_conn* table = (split_conn*)(huge ? huge_pages::alloc(table_bytes) : small_pages(table_bytes));
+        char* buffers = (char*)(huge ? huge_pages::alloc(buffer_bytes) : small_pages(buffer_bytes));
+        for (int i = 0; i < active; ++i) {
+            table[fds[i]].read_buf = buffers + (size_t)i * BUFFERS_SIZE;
+            table[fds[i]].write_buf = table[fds[i]].read_buf + http_conn::READ_BUFFER_SIZE;
+        }
+        run(huge ? "split-huge" : "split-4k", fds, events, perf_fd, [&](int fd) {
+            split_conn& c = table[fd];
+            c.state ^= 1;
+            c.read_idx += c.read_buf[c.checked_idx & 63];
+            c.bytes_to_send = c.write_idx + c.sockfd;
+            return c.read_idx;
+        });
+        if (huge) {
+            huge_pages::free(table, table_bytes);
+            huge_pages::free(buffers, buffer_bytes);
+        } else {
+            munmap(table, table_bytes);
+            munmap(buffers, buffer_bytes);
+        }
+    }
+    huge_pages::dump_stats(stdout);
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "trace.h"
+#include "locker.h"
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+bool tracer::m_enabled = false;
+int tracer::m_sample_rate = 1;
+
+namespace {
+
+// Events kept per thread, the oldest ones are overwritten
+const size_t BUFFER_EVENTS = 65536;
+
+const char* stage_names[] = {"accept", "read", "enqueue", "dequeue", "parse done", "file ready", "first byte", "complete"};
+
+struct trace_event {
+    uint64_t id;
+    uint64_t ts_ns;
+    int fd;
+    int tid;
+    tracer::STAGE stage;
+};
+
+/*
+    Ring buffer of one thread.
+    Only its thread writes to it, the lock is contended only while dump() copies it.
+    Buffers of exited threads are marked dead and freed by the next dump().
+*/
+struct trace_buffer {
+    locker lock;
+    std::vector<trace_event> events;
+    size_t next = 0;
+    bool dead = false;
+};
+
+locker registry_lock;
+std::vector<trace_buffer*> registry;
+std::atomic<uint64_t> request_counter(0);
+
+struct buffer_owner {
+    trace_buffer* buffer = nullptr;
+    ~buffer_owner() {
+        if (buffer) {
+            registry_lock.lock();
+            buffer->dead = true;
+            registry_lock.unlock();
+        }
+    }
+};
+
+trace_buffer* thread_buffer() {
+    static thread_local buffer_owner owner;
+    if (!owner.buffer) {
+        owner.buffer = new trace_buffer;
+        owner.buffer->events.reserve(BUFFER_EVENTS);
+        registry_lock.lock();
+        registry.push_back(owner.buffer);
+        registry_lock.unlock();
+    }
+    return owner.buffer;
+}
+
+int thread_id() {
+    static thread_local int tid = syscall(SYS_gettid);
+    return tid;
+}
+
+}
+
+void tracer::enable(int sample_rate) {
+    m_sample_rate = sample_rate > 0 ? sample_rate : 1;
+    m_enabled = true;
+}
+
+uint64_t tracer::sample() {
+    if (!m_enabled) {
+        return 0;
+    }
+    uint64_t n = ++request_counter;
+    return (n % m_sample_rate == 0) ? n : 0;
+}
+
+void tracer::record(uint64_t id, STAGE stage, int fd) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    trace_event ev = {id, (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec, fd, thread_id(), stage};
+
+    trace_buffer* buf = thread_buffer();
+    buf->lock.lock();
+    if (buf->events.size() < BUFFER_EVENTS) {
+        buf->events.push_back(ev);
+    } else {
+        buf->events[buf->next] = ev;
+        buf->next = (buf->next + 1) % BUFFER_EVENTS;
+    }
+    buf->lock.unlock();
+}
+
+/*
+    Every stage becomes an instant event on the thread that recorded it,
+    and the time between two stages of a request an async slice ("read -> enqueue") on the track of that request.
+*/
+bool tracer::dump(const char* path) {
+    std::vector<trace_event> events;
+    registry_lock.lock();
+    for (size_t i = 0; i < registry.size(); ) {
+        trace_buffer* buf = registry[i];
+        buf->lock.lock();
+        events.insert(events.end(), buf->events.begin(), buf->events.end());
+        buf->events.clear();
+        buf->next = 0;
+        buf->lock.unlock();
+        if (buf->dead) {
+            delete buf;
+            registry[i] = registry.back();
+            registry.pop_back();
+        } else {
+            ++i;
+        }
+    }
+    registry_lock.unlock();
+
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        perror("fopen");
+        return false;
+    }
+
+    std::sort(events.begin(), events.end(), [](const trace_event& a, const trace_event& b) {
+        return a.id != b.id ? a.id < b.id : a.ts_ns < b.ts_ns;
+    });
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (size_t i = 0; i < events.size(); ++i) {
+        const trace_event& ev = events[i];
+        fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"request\":%lu,\"fd\":%d}}",
+            first ? "" : ",\n", stage_names[ev.stage], ev.ts_ns / 1000.0, ev.tid, (unsigned long)ev.id, ev.fd);
+        first = false;
+
+        if (i + 1 < events.size() && events[i + 1].id == ev.id) {
+            const trace_event& next = events[i + 1];
+            fprintf(fp, ",\n{\"name\":\"%s -> %s\",\"cat\":\"request\",\"ph\":\"b\",\"id\":%lu,\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+                stage_names[ev.stage], stage_names[next.stage], (unsigned long)ev.id, ev.ts_ns / 1000.0, ev.tid);
+            fprintf(fp, ",\n{\"name\":\"%s -> %s\",\"cat\":\"request\",\"ph\":\"e\",\"id\":%lu,\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+                stage_names[ev.stage], stage_names[next.stage], (unsigned long)ev.id, next.ts_ns / 1000.0, ev.tid);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+
+    printf("Wrote %zu trace events to %s\n", events.size(), path);
+    return true;
+}
@@ -0,0 +1,29 @@
+// Sampled per-request tracing, exported in Chrome trace-event format (chrome://tracing, ui.perfetto.dev)
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+class tracer {
+public:
+    // Points of the request lifecycle that are recorded
+    enum STAGE {ACCEPT = 0, READ, ENQUEUE, DEQUEUE, PARSE_DONE, FILE_READY, FIRST_BYTE, COMPLETE};
+
+    // Trace one request out of every sample_rate
+    static void enable(int sample_rate);
+    // Id of a new request, 0 if tracing is disabled or the request isn't sampled
+    static uint64_t sample();
+    // Append a timestamped stage to the buffer of the calling thread
+    static void record(uint64_t id, STAGE stage, int fd);
+    // Write all buffered events to path as a trace JSON file and clear the buffers
+    static bool dump(const char* path);
+
+private:
+    static bool m_enabled;
+    static int m_sample_rate;
+};
+
+// A single predictable branch for requests that aren't sampled
+#define TRACE_STAGE(id, stage, fd) do { if ((id) != 0) { tracer::record((id), tracer::stage, (fd)); } } while (0)
+
+#endif
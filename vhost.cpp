@@ -0,0 +1,181 @@
+#include "vhost.h"
+#include "file_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+namespace {
+
+const int MAX_HOSTS = 256;
+// Longest host name looked up, longer names can't be configured either
+const size_t MAX_NAME_LEN = 255;
+
+// Hosts added at startup, the default host last; sizes in MB, 0 for a share of the rest
+vhost hosts[MAX_HOSTS + 1];
+int sizes[MAX_HOSTS];
+int host_count = 0;
+vhost* default_vhost = NULL;
+
+// Open addressing, at most half full: the probe sequence of a missing name is short
+vhost** table = NULL;
+size_t table_mask = 0;
+
+// FNV-1a of the name as it's normalized: lower case, up to the port
+uint32_t normalize(const char* host, char* name, size_t* len) {
+    uint32_t hash = 2166136261u;
+    size_t n = 0;
+    // [v6 address]:port keeps its brackets, the port goes
+    bool bracket = host[0] == '[';
+    for (const char* p = host; *p && n < MAX_NAME_LEN; ++p) {
+        if (bracket ? (p != host && p[-1] == ']') : *p == ':') {
+            break;
+        }
+        if (*p == ' ' || *p == '\t' || *p == '\r') {
+            break;
+        }
+        char c = tolower((unsigned char)*p);
+        name[n++] = c;
+        hash = (hash ^ (unsigned char)c) * 16777619u;
+    }
+    // A fully qualified name may end with a dot
+    if (n > 0 && name[n - 1] == '.') {
+        n --;
+        hash = 2166136261u;
+        for (size_t i = 0; i < n; ++i) {
+            hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+        }
+    }
+    name[n] = '\0';
+    *len = n;
+    return hash;
+}
+
+}
+
+bool vhost_table::add(const char* spec) {
+    const char* eq = strchr(spec, '=');
+    if (!eq || eq == spec || (size_t)(eq - spec) > MAX_NAME_LEN || !eq[1] || host_count >= MAX_HOSTS) {
+        return false;
+    }
+    std::string root(eq + 1);
+    int mb = 0;
+    // root[:MB], the size only if what follows the last colon is a number
+    size_t colon = root.rfind(':');
+    if (colon != std::string::npos && colon + 1 < root.size()
+        && strspn(root.c_str() + colon + 1, "0123456789") == root.size() - colon - 1) {
+        mb = atoi(root.c_str() + colon + 1);
+        root.resize(colon);
+    }
+    if (root.empty() || root.size() > MAX_ROOT_LEN) {
+        return false;
+    }
+
+    char name[MAX_NAME_LEN + 1];
+    size_t len;
+    std::string host(spec, eq - spec);
+    normalize(host.c_str(), name, &len);
+    for (int i = 0; i < host_count; ++i) {
+        if (hosts[i].name == name) {
+            return false;
+        }
+    }
+    hosts[host_count].name = name;
+    hosts[host_count].root = root;
+    sizes[host_count] = mb;
+    host_count ++;
+    return true;
+}
+
+void vhost_table::start(const char* default_root, size_t capacity) {
+    // 1. Slices of the cache: the sized hosts first, the rest shared equally
+    size_t sized = 0;
+    int unsized = 1;
+    for (int i = 0; i < host_count; ++i) {
+        if (sizes[i] > 0) {
+            sized += (size_t)sizes[i] * 1024 * 1024;
+        } else {
+            unsized ++;
+        }
+    }
+    size_t share = capacity > sized ? (capacity - sized) / unsized : 0;
+    if (share < 1024 * 1024) {
+        share = 1024 * 1024;
+    }
+    if (host_count > 0 && sized + share * unsized > capacity) {
+        printf("Warning: the file caches of the virtual hosts add up to %zu MB, more than the %zu MB of -m\n",
+            (sized + share * unsized) >> 20, capacity >> 20);
+    }
+    for (int i = 0; i < host_count; ++i) {
+        hosts[i].cache = new file_cache(sizes[i] > 0 ? (size_t)sizes[i] * 1024 * 1024 : share);
+    }
+    default_vhost = &hosts[host_count];
+    default_vhost->root = default_root;
+    default_vhost->cache = new file_cache(host_count > 0 ? share : capacity);
+
+    // 2. The lookup table
+    size_t size = 4;
+    while (size < (size_t)host_count * 2) {
+        size *= 2;
+    }
+    table = new vhost*[size]();
+    table_mask = size - 1;
+    for (int i = 0; i < host_count; ++i) {
+        char name[MAX_NAME_LEN + 1];
+        size_t len;
+        size_t slot = normalize(hosts[i].name.c_str(), name, &len) & table_mask;
+        while (table[slot]) {
+            slot = (slot + 1) & table_mask;
+        }
+        table[slot] = &hosts[i];
+    }
+}
+
+void vhost_table::stop() {
+    for (int i = 0; i <= host_count; ++i) {
+        delete hosts[i].cache;
+        hosts[i].cache = NULL;
+    }
+    delete[] table;
+    table = NULL;
+}
+
+vhost* vhost_table::find(const char* host) {
+    if (!host || host_count == 0) {
+        return default_vhost;
+    }
+    char name[MAX_NAME_LEN + 1];
+    size_t len;
+    size_t slot = normalize(host, name, &len) & table_mask;
+    while (table[slot]) {
+        const std::string& n = table[slot]->name;
+        if (n.size() == len && memcmp(n.data(), name, len) == 0) {
+            return table[slot];
+        }
+        slot = (slot + 1) & table_mask;
+    }
+    return default_vhost;
+}
+
+vhost* vhost_table::default_host() {
+    return default_vhost;
+}
+
+int vhost_table::count() {
+    return host_count;
+}
+
+vhost* vhost_table::host(int i) {
+    return &hosts[i];
+}
+
+void vhost_table::dump_stats(FILE* fp) {
+    if (host_count == 0) {
+        return;
+    }
+    for (int i = 0; i <= host_count; ++i) {
+        vhost& h = hosts[i];
+        fprintf(fp, "vhost %s: %s, %lu requests, ", h.name.empty() ? "(default)" : h.name.c_str(), h.root.c_str(), h.requests.load());
+        h.cache->dump_stats(fp);
+    }
+}
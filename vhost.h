@@ -0,0 +1,52 @@
+// Name-based virtual hosts: the Host header selects the document root and the file cache of a request
+#ifndef VHOST_H
+#define VHOST_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+
+class file_cache;
+
+// One site served by the process
+struct vhost {
+    // Lower case, without port; empty for the default host
+    std::string name;
+    std::string root;
+    // The host's own file cache: a busy site evicts only its own files
+    file_cache* cache;
+    std::atomic<unsigned long> requests{0};
+};
+
+/*
+    Hosts are added at startup (-V host=root[:MB]), then start() freezes them into an open-addressing hash table:
+    a lookup hashes the Host header once, case-insensitively and without its port, and compares a single name
+    in the common case. Requests without a Host header or for an unknown host go to the default host (-r).
+    A host without a size gets an equal share, with the default host, of the -m capacity left by the sized ones,
+    and at least 1 MB: start() warns when that takes the caches past -m.
+*/
+class vhost_table {
+public:
+    // Longest document root of a host, so that root + URL fits the path buffer of a connection
+    static const size_t MAX_ROOT_LEN = 100;
+
+    // Add a host "name=root[:MB]" before start(), e.g. "example.com=/srv/example:16"
+    static bool add(const char* spec);
+    // Create the default host and the caches, and build the lookup table. capacity: file cache size of -m, in bytes.
+    static void start(const char* default_root, size_t capacity);
+    // Delete the caches, once no connection uses them
+    static void stop();
+
+    // Host of a Host header value (any case, with or without a port), the default host if it isn't known
+    static vhost* find(const char* host);
+    static vhost* default_host();
+    static int count();
+    // Host i, for 0 <= i <= count(): the added hosts in order, then the default host
+    static vhost* host(int i);
+
+    // Per-host requests and cache usage
+    static void dump_stats(FILE* fp);
+};
+
+#endif
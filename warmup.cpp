@@ -0,0 +1,173 @@
+#include "warmup.h"
+#include "file_cache.h"
+#include "vhost.h"
+#include "locker.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <algorithm>
+
+namespace {
+
+// Files kept in the summary, all hosts together
+const size_t HOT_SET_SIZE = 1024;
+const char HEADER_V1[] = "# webServer hot set\n";
+const char HEADER_V2[] = "# webServer hot set 2\n";
+
+const char* hot_set_path = NULL;
+int save_interval = 60;
+int warm_seconds = 30;
+size_t warm_bytes = 0;
+
+std::atomic<bool> stopping(false);
+pthread_t saver_thread;
+pthread_t warm_thread;
+bool running = false;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Written next to the old file and renamed, a crash never leaves a truncated summary
+void save() {
+    // The busiest files of every host, then the busiest of those overall
+    std::vector<std::pair<file_cache::hot_file, const vhost*>> files;
+    for (int i = 0; i <= vhost_table::count(); ++i) {
+        const vhost* h = vhost_table::host(i);
+        for (file_cache::hot_file& f : h->cache->hot_files(HOT_SET_SIZE)) {
+            files.emplace_back(std::move(f), h);
+        }
+    }
+    if (files.empty()) {
+        // No traffic since the last snapshot: keep what the previous run learned
+        return;
+    }
+    std::stable_sort(files.begin(), files.end(), [](const auto& a, const auto& b) { return a.first.hits > b.first.hits; });
+    if (files.size() > HOT_SET_SIZE) {
+        files.resize(HOT_SET_SIZE);
+    }
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", hot_set_path);
+    FILE* fp = fopen(tmp, "w");
+    if (!fp) {
+        perror(tmp);
+        return;
+    }
+    fputs(HEADER_V2, fp);
+    for (const auto& it : files) {
+        const file_cache::hot_file& f = it.first;
+        fprintf(fp, "%lu %lld %s %s\n", f.hits, (long long)f.size, it.second->name.empty() ? "-" : it.second->name.c_str(),
+            f.path.c_str());
+    }
+    if (fclose(fp) != 0 || rename(tmp, hot_set_path) < 0) {
+        perror(hot_set_path);
+    }
+}
+
+void* saver(void*) {
+    double last = now();
+    while (!stopping) {
+        // Short sleeps so that stop() doesn't wait for a whole interval
+        usleep(200 * 1000);
+        if (now() - last >= save_interval) {
+            save();
+            last = now();
+        }
+    }
+    return NULL;
+}
+
+void loaded(void* arg) {
+    ((sem*)arg)->post();
+}
+
+void* warm(void*) {
+    FILE* fp = fopen(hot_set_path, "r");
+    if (!fp) {
+        return NULL;
+    }
+
+    double start = now();
+    size_t bytes = 0;
+    int files = 0;
+    sem done;
+    char line[1200] = "";
+    bool with_host = fgets(line, sizeof(line), fp) && strcmp(line, HEADER_V2) == 0;
+    if (!with_host && strcmp(line, HEADER_V1) != 0) {
+        printf("%s: not a hot-set file\n", hot_set_path);
+        fclose(fp);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), fp) && !stopping) {
+        unsigned long hits;
+        long long size;
+        char name[256] = "-";
+        int offset;
+        int fields = with_host ? sscanf(line, "%lu %lld %255s %n", &hits, &size, name, &offset)
+                               : sscanf(line, "%lu %lld %n", &hits, &size, &offset);
+        if (line[0] == '#' || fields < (with_host ? 3 : 2)) {
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        const char* path = line + offset;
+        // find() falls back to the default host, which only "-" names
+        vhost* h = vhost_table::find(name);
+        if ((h->name.empty() ? strcmp(name, "-") != 0 : h->name != name)
+            || strncmp(path, h->root.c_str(), h->root.size()) != 0) {
+            continue;
+        }
+        if (now() - start > warm_seconds) {
+            break;
+        }
+        // Smaller files further down may still fit the budget
+        if (bytes + size > warm_bytes) {
+            continue;
+        }
+
+        // The previous run's counts carry over, halved like at every snapshot
+        file_entry* entry;
+        file_cache* cache = h->cache;
+        file_cache::STATUS status = cache->acquire(path, &entry, hits / 2);
+        if (status != file_cache::FILE_READY && status != file_cache::FILE_PENDING) {
+            continue;
+        }
+        // One load at a time, the loader threads are shared with the live traffic
+        if (cache->wait(entry, loaded, &done)) {
+            done.wait();
+        }
+        bytes += entry->st.st_size;
+        files ++;
+        cache->release(entry);
+    }
+    fclose(fp);
+    printf("Warmed %d files, %zu bytes in %.2f s\n", files, bytes, now() - start);
+    return NULL;
+}
+
+}
+
+void cache_warmer::start(const char* path, int interval, int budget_seconds, size_t budget_bytes) {
+    hot_set_path = path;
+    save_interval = interval > 0 ? interval : 60;
+    warm_seconds = budget_seconds;
+    warm_bytes = budget_bytes;
+    pthread_create(&warm_thread, NULL, warm, NULL);
+    pthread_create(&saver_thread, NULL, saver, NULL);
+    running = true;
+}
+
+void cache_warmer::stop() {
+    if (!running) {
+        return;
+    }
+    stopping = true;
+    pthread_join(warm_thread, NULL);
+    pthread_join(saver_thread, NULL);
+    save();
+    running = false;
+}
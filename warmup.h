@@ -0,0 +1,27 @@
+// Hot-set persistence and cache warming across restarts
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include <stddef.h>
+
+/*
+    A saver thread periodically writes the hot set of the file caches of all the virtual hosts (see
+    file_cache::hot_files()) to a small text file, most requested first:
+        # webServer hot set 2
+        <hits> <bytes> <host> <path>
+        ...
+    host is "-" for the default host. Files of the first version have no host column, they are the default host's.
+    At startup a warming thread reads the file of the previous run and acquires its files into the cache of their host,
+    while the server already accepts traffic: cold files go through the loader threads, so they end up both in the
+    page cache and in the file cache. Warming stops at the time or memory budget; files of a host that is no longer
+    configured, or under a root that changed, are skipped.
+*/
+class cache_warmer {
+public:
+    // Warm the caches of vhost_table from path if it exists, then keep saving the hot set to it every interval seconds
+    static void start(const char* path, int interval, int budget_seconds, size_t budget_bytes);
+    // Stop both threads and write a last summary
+    static void stop();
+};
+
+#endif